@@ -1,10 +1,26 @@
+#include <dlfcn.h>
 #include "gflags.h"
 
 using gflags::clstring;
 using gflags::CommandLineFlag;
+using gflags::CommandLineFlagParser;
+using gflags::CrossFlagConstraint;
+using gflags::CrossFlagValidateFn;
+using gflags::FlagConstraint;
+using gflags::FlagConstraintInfo;
+using gflags::FlagOverride;
+using gflags::FlagRegistrationCost;
+using gflags::FlagRegistrationRecord;
 using gflags::FlagRegistry;
 using gflags::FlagRegistryLock;
+using gflags::FlagRegistryReaderLock;
+using gflags::FlagShardLock;
+using gflags::FlagStats;
 using gflags::FlagSettingMode;
+using gflags::FlagValue;
+using gflags::LazyString;
+using gflags::Mutex;
+using gflags::MutexLock;
 using gflags::Gflags;
 using gflags::int32;
 using gflags::int64;
@@ -95,9 +111,15 @@ uint32 Gflags::ParseCommandLineFlagsInternal(int *argc, char ***argv,
   // Now get the flags specified on the commandline
   const int r = parser.ParseNewCommandLineFlags(argc, argv, remove_flags);
 
+  if (do_report)
+    HandleCommandLineHelpFlags(); // may cause us to exit on --help, etc.
+
   // See if any of the unset flags fail their validation checks
   parser.ValidateUnmodifiedFlags();
 
+  if (parser.ReportErrors()) // may cause us to exit on illegal flags
+    gflags_exitfunc(1);
+
   return r;
 }
 
@@ -109,16 +131,211 @@ bool Gflags::GetCommandLineOption(const char *name, string *value) {
   assert(value);
 
   FlagRegistry *const registry = FlagRegistry::GlobalRegistry();
-  FlagRegistryLock frl(registry);
+  FlagRegistryReaderLock frl(registry);
   CommandLineFlag *flag = registry->FindFlagLocked(name);
   if (flag == NULL) {
     return false;
   } else {
+    FlagShardLock fsl(registry, FlagRegistry::ShardBit(flag), false);
     *value = flag->current_value();
     return true;
   }
 }
 
+string Gflags::SetCommandLineOption(const char *name, const char *value) {
+  return SetCommandLineOptionWithMode(name, value, SET_FLAGS_VALUE);
+}
+
+string Gflags::SetCommandLineOptionWithMode(const char *name,
+                                            const char *value,
+                                            FlagSettingMode set_mode) {
+  string result;
+  FlagRegistry *const registry = FlagRegistry::GlobalRegistry();
+  FlagRegistryReaderLock frl(registry);
+  CommandLineFlag *flag = registry->FindFlagLocked(name);
+  if (flag) {
+    FlagShardLock fsl(registry, registry->SetShardMaskLocked(flag), true);
+    CommandLineFlagParser parser(this, registry);
+    result = parser.ProcessSingleOptionLocked(flag, value, set_mode);
+  }
+  // The API of this function is that we return empty string on error
+  return result;
+}
+
+bool Gflags::RegisterCommandLineFlag(const char *name, const char *help,
+                                     const char *filename,
+                                     clstring *current_storage,
+                                     LazyString *defvalue_storage,
+                                     const FlagConstraint *constraint) {
+  GFLAGS_REGISTRATION_TIMER(filename, current_storage);
+  if (help == NULL)
+    help = "";
+
+  FlagValue *const current = new FlagValue(current_storage, false);
+  FlagValue *const defvalue = new FlagValue(defvalue_storage);
+  // Importantly, flag_ will never be deleted, so storage is always good.
+  CommandLineFlag *flag =
+      new CommandLineFlag(name, help, filename, current, defvalue);
+  // default registry
+  FlagRegistry::GlobalRegistry()->RegisterFlag(flag, constraint);
+  return true;
+}
+
+bool Gflags::RegisterCrossFlagValidator(const char *name,
+                                        CrossFlagValidateFn validate_fn,
+                                        const void *const *flag_ptrs,
+                                        size_t num_flags) {
+  FlagRegistry *const registry = FlagRegistry::GlobalRegistry();
+  FlagRegistryLock frl(registry);
+  CrossFlagConstraint *constraint = new CrossFlagConstraint;
+  constraint->name = name;
+  constraint->validate_fn = validate_fn;
+  constraint->pending = false;
+  constraint->checked_batch = 0;
+  for (size_t i = 0; i < num_flags; ++i) {
+    CommandLineFlag *flag = registry->FindFlagViaPtrLocked(flag_ptrs[i]);
+    if (!flag) {
+      std::cout << "Ignoring RegisterCrossFlagValidator() for '" << name
+                << "': no flag found at address " << flag_ptrs[i];
+      delete constraint;
+      return false;
+    }
+    constraint->flags.push_back(flag);
+  }
+  registry->RegisterCrossFlagConstraintLocked(constraint);
+  return true;
+}
+
+void Gflags::GetFlagConstraints(vector<FlagConstraintInfo> *output) {
+  assert(output);
+  FlagRegistry *const registry = FlagRegistry::GlobalRegistry();
+  FlagRegistryLock frl(registry);
+  for (FlagRegistry::FlagConstIterator i = registry->flags_.begin();
+       i != registry->flags_.end(); ++i) {
+    const CommandLineFlag *flag = i->second;
+    if (flag->constraint() == NULL)
+      continue;
+    FlagConstraintInfo info;
+    info.name = flag->name();
+    info.type = flag->type_name();
+    info.filename = flag->filename();
+    info.constraint = flag->constraint();
+    output->push_back(info);
+  }
+}
+
+void Gflags::GetFlagsMatching(const char *pattern,
+                              vector<const CommandLineFlag *> *output) {
+  assert(pattern && output);
+  FlagRegistry *const registry = FlagRegistry::GlobalRegistry();
+  FlagRegistryReaderLock frl(registry);
+  registry->GetFlagsMatchingLocked(pattern, output);
+}
+
+// --------------------------------------------------------------------
+// Registration profile
+//    Flags register from static initializers, possibly before anything
+//    else in this file is constructed, so the records live behind a
+//    function-local static like the global registry does.
+// --------------------------------------------------------------------
+
+static Mutex *RegistrationProfileLock() {
+  static Mutex lock(Mutex::LINKER_INITIALIZED);
+  return &lock;
+}
+
+static vector<FlagRegistrationRecord> *RegistrationProfile() {
+  static vector<FlagRegistrationRecord> *records =
+      new vector<FlagRegistrationRecord>;
+  return records;
+}
+
+void gflags::RecordFlagRegistration(const FlagRegistrationRecord &record) {
+  MutexLock l(RegistrationProfileLock());
+  RegistrationProfile()->push_back(record);
+}
+
+void Gflags::GetRegistrationProfile(vector<FlagRegistrationRecord> *output) {
+  MutexLock l(RegistrationProfileLock());
+  *output = *RegistrationProfile();
+}
+
+static bool CostlierThan(const FlagRegistrationCost &a,
+                         const FlagRegistrationCost &b) {
+  return a.total_ns > b.total_ns;
+}
+
+typedef const char *(*RegistrationKeyFn)(const FlagRegistrationRecord &);
+
+// Sums records up by key(record), costliest first.
+static void SumRegistrationCost(RegistrationKeyFn key,
+                                vector<FlagRegistrationCost> *output) {
+  vector<FlagRegistrationRecord> records;
+  Gflags::GetRegistrationProfile(&records);
+  std::map<string, FlagRegistrationCost> costs;
+  for (size_t i = 0; i < records.size(); ++i) {
+    const FlagRegistrationRecord &r = records[i];
+    const char *name = key(r);
+    std::map<string, FlagRegistrationCost>::iterator c = costs.find(name);
+    if (c == costs.end()) {
+      FlagRegistrationCost cost;
+      cost.name = name;
+      cost.flags = 0;
+      cost.total_ns = 0;
+      cost.first_ns = r.start_ns;
+      c = costs.insert(std::make_pair(cost.name, cost)).first;
+    }
+    c->second.flags++;
+    c->second.total_ns += r.duration_ns;
+    c->second.last_ns = r.start_ns;
+  }
+  output->clear();
+  for (std::map<string, FlagRegistrationCost>::const_iterator c = costs.begin();
+       c != costs.end(); ++c) {
+    output->push_back(c->second);
+  }
+  std::stable_sort(output->begin(), output->end(), CostlierThan);
+}
+
+static const char *RecordFile(const FlagRegistrationRecord &record) {
+  return record.filename;
+}
+
+static const char *RecordObject(const FlagRegistrationRecord &record) {
+  // The flag's storage is in the data segment of the object that
+  // defined it.
+  Dl_info info;
+  if (dladdr(record.storage, &info) == 0 || info.dli_fname == NULL)
+    return "(unknown)";
+  return info.dli_fname;
+}
+
+void Gflags::GetRegistrationCostByFile(vector<FlagRegistrationCost> *output) {
+  SumRegistrationCost(RecordFile, output);
+}
+
+void Gflags::GetRegistrationCostByObject(
+    vector<FlagRegistrationCost> *output) {
+  SumRegistrationCost(RecordObject, output);
+}
+
+FlagStats Gflags::GetStats() {
+  FlagStats stats;
+  FlagRegistry::GlobalRegistry()->GetStats(&stats);
+  return stats;
+}
+
+__thread FlagOverride *FlagOverride::top_ = NULL;
+
+const void *FlagOverride::Find(const void *flag_ptr) {
+  // Innermost first, so nested scopes for the same flag shadow outer ones.
+  for (const FlagOverride *o = top_; o != NULL; o = o->prev_) {
+    if (o->flag_ptr_ == flag_ptr)
+      return o->value_;
+  }
+  return NULL;
+}
+
 // Clean up memory allocated by flags.  This is only needed to reduce
 // the quantity of "potentially leaked" reports emitted by memory
 // debugging tools such as valgrind.  It is not required for normal
@@ -10,19 +10,26 @@
 #include <inttypes.h>
 #include <fnmatch.h>
 #include <stdarg.h> // For va_list and related operations
+#include <time.h>
 
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
 #include <algorithm>
+#include <atomic>
+#include <memory>
 
 #include "gflags_mutex.h"
+#include "gflags_stats.h"
 
 #ifndef __STDC_FORMAT_MACROS
 #define __STDC_FORMAT_MACROS
 #endif
 
+// For keeping independently written data on separate cache lines.
+#define GFLAGS_CACHELINE_SIZE 64
+
 namespace gflags {
 
 using std::cout;
@@ -38,16 +45,110 @@ typedef int64_t int64;
 typedef uint64_t uint64;
 typedef string clstring;
 
+// The values of DEFINE_*_list flags.  A list is parsed from "a,b,c" once,
+// when the flag is set, so readers just walk a contiguous array.
+typedef vector<int32> Int32List;
+typedef vector<int64> Int64List;
+typedef vector<double> DoubleList;
+
+// The value of a DEFINE_string_list flag.  All the elements live in one
+// arena, each followed by a NUL, rather than in a string object apiece.
+class StringList {
+public:
+  size_t size() const { return offsets_.size(); }
+  bool empty() const { return offsets_.empty(); }
+  // The i-th element, NUL-terminated.
+  const char *operator[](size_t i) const {
+    return arena_.c_str() + offsets_[i];
+  }
+  size_t length(size_t i) const {
+    const size_t end = i + 1 < size() ? offsets_[i + 1] : arena_.size();
+    return end - offsets_[i] - 1;
+  }
+
+  void clear() {
+    arena_.clear();
+    offsets_.clear();
+  }
+  void reserve(size_t elements, size_t bytes) {
+    offsets_.reserve(elements);
+    arena_.reserve(bytes + elements);
+  }
+  void push_back(const char *s, size_t n) {
+    offsets_.push_back(arena_.size());
+    arena_.append(s, n);
+    arena_.push_back('\0');
+  }
+  void swap(StringList &x) {
+    arena_.swap(x.arena_);
+    offsets_.swap(x.offsets_);
+  }
+
+  // Elements cannot contain NULs, so the arenas alone decide equality.
+  bool operator==(const StringList &x) const { return arena_ == x.arena_; }
+  bool operator!=(const StringList &x) const { return arena_ != x.arena_; }
+
+private:
+  string arena_;
+  vector<size_t> offsets_; // where each element starts in arena_
+};
+
+// The value of a DEFINE_duration flag, held as nanoseconds.  It is
+// written as one or more decimal numbers with a unit each, such as
+// "250ms", "1.5s" or "1h30m", optionally signed; the units are ns, us,
+// ms, s, m and h, and "0" needs none.
+class Duration {
+public:
+  constexpr Duration() : nanos_(0) {}
+  explicit constexpr Duration(int64 nanos) : nanos_(nanos) {}
+
+  constexpr int64 nanoseconds() const { return nanos_; }
+  constexpr int64 microseconds() const { return nanos_ / 1000; }
+  constexpr int64 milliseconds() const { return nanos_ / 1000000; }
+  constexpr double seconds() const { return nanos_ / 1e9; }
+
+  constexpr bool operator==(Duration x) const { return nanos_ == x.nanos_; }
+  constexpr bool operator!=(Duration x) const { return nanos_ != x.nanos_; }
+
+private:
+  int64 nanos_;
+};
+
+// The value of a DEFINE_bytes flag.  It is written as a decimal number
+// with an optional unit: B, the decimal kB, KB, MB, GB, TB and PB, or
+// the binary KiB, MiB, GiB, TiB and PiB.  "1.5GiB" is fine as long as
+// it comes to a whole number of bytes.
+class ByteSize {
+public:
+  constexpr ByteSize() : bytes_(0) {}
+  explicit constexpr ByteSize(uint64 bytes) : bytes_(bytes) {}
+
+  constexpr uint64 bytes() const { return bytes_; }
+
+  constexpr bool operator==(ByteSize x) const { return bytes_ == x.bytes_; }
+  constexpr bool operator!=(ByteSize x) const { return bytes_ != x.bytes_; }
+
+private:
+  uint64 bytes_;
+};
+
 typedef bool (*ValidateFnProto)();
 
+// A validator over several flags; it reads the FLAGS_* variables itself.
+typedef bool (*CrossFlagValidateFn)();
+
 class FlagValue;
 
 class CommandLineFlag;
 
 class FlagRegistry;
 
+class FlagTable;
+
 class Gflags;
 
+class FlagView;
+
 enum ValueType {
   FV_BOOL = 0,
   FV_INT32 = 1,
@@ -56,7 +157,81 @@ enum ValueType {
   FV_UINT64 = 4,
   FV_DOUBLE = 5,
   FV_STRING = 6,
-  FV_MAX_INDEX = 6,
+  FV_INT32_LIST = 7,
+  FV_INT64_LIST = 8,
+  FV_DOUBLE_LIST = 9,
+  FV_STRING_LIST = 10,
+  FV_DURATION = 11,
+  FV_BYTES = 12,
+  FV_CUSTOM = 13, // a type described by FlagTypeOps
+  FV_MAX_INDEX = 13,
+};
+
+enum ConstraintKind {
+  FC_INT_RANGE = 0,    // int32/int64 flags: int_lo <= value <= int_hi
+  FC_UINT_RANGE = 1,   // uint32/uint64 flags: uint_lo <= value <= uint_hi
+  FC_DOUBLE_RANGE = 2, // double flags: double_lo <= value <= double_hi
+  FC_ONEOF = 3,        // string flags: one of the '|'-separated choices
+};
+
+// A constraint declared next to a flag by DEFINE_*_range or
+// DEFINE_string_oneof.  Unlike a validator it is plain data: the typed
+// set path checks it inline, and tools can list every flag's constraint
+// (see Gflags::GetFlagConstraints) without calling into user code.
+struct FlagConstraint {
+  ConstraintKind kind;
+  int64 int_lo, int_hi;
+  uint64 uint_lo, uint_hi;
+  double double_lo, double_hi;
+  const char *choices;
+
+  static constexpr FlagConstraint IntRange(int64 lo, int64 hi) {
+    return FlagConstraint{FC_INT_RANGE, lo, hi, 0, 0, 0.0, 0.0, NULL};
+  }
+  static constexpr FlagConstraint UintRange(uint64 lo, uint64 hi) {
+    return FlagConstraint{FC_UINT_RANGE, 0, 0, lo, hi, 0.0, 0.0, NULL};
+  }
+  static constexpr FlagConstraint DoubleRange(double lo, double hi) {
+    return FlagConstraint{FC_DOUBLE_RANGE, 0, 0, 0, 0, lo, hi, NULL};
+  }
+  static constexpr FlagConstraint OneOf(const char *choices) {
+    return FlagConstraint{FC_ONEOF, 0, 0, 0, 0, 0.0, 0.0, choices};
+  }
+
+  // Human-readable form, eg "[1, 10]" or "{fast|safe}".
+  string ToString() const;
+  // True if no value satisfies this, eg the range [10, 0].
+  bool Empty() const;
+};
+
+// The default of a DEFINE_string flag when built with
+// GFLAGS_LAZY_STRING_DEFAULTS: the literal, plus raw space in which the
+// clstring is constructed the first time the registry needs it.  It is
+// constant-initialized, so it costs no allocation before main and is
+// usable no matter where static initialization of its file stands.
+struct LazyString {
+  const char *literal;
+  bool constructed;
+  alignas(clstring) char storage[sizeof(clstring)];
+};
+
+// A relation between several flags, registered with DEFINE_cross_validator.
+// The FlagRegistry indexes it by every flag in flags, so that setting one
+// flag only re-evaluates the constraints that read it.
+struct CrossFlagConstraint {
+  const char *name;
+  CrossFlagValidateFn validate_fn;
+  vector<CommandLineFlag *> flags; // the flags validate_fn reads
+  bool pending;                    // touched by the open batch
+  uint64 checked_batch;            // last batch that evaluated it, or 0
+};
+
+// One row of the constraint table returned by Gflags::GetFlagConstraints().
+struct FlagConstraintInfo {
+  string name;
+  string type;
+  string filename;
+  const FlagConstraint *constraint; // owned by the flag's defining file
 };
 
 enum FlagSettingMode {
@@ -84,6 +259,10 @@ extern void (*gflags_exitfunc)(int); // from stdlib.h
 
 static const char kError[] = "ERROR: ";
 
+// The help text of every flag when built with GFLAGS_STRIP_HELP.  It
+// starts with \001 so code can tell it apart from real help.
+extern const char kStrippedFlagHelp[];
+
 // Report Error and exit if requested.
 extern void ReportError(DieWhenReporting should_die, const char *format, ...);
 
@@ -97,13 +276,103 @@ extern void StringAppendF(std::string *output, const char *format, ...);
 // This could be a templated method of FlagValue, but doing so adds to the
 // size of the .o.  Since there's no type-safety here anyway, macro is ok.
 
+// If changed is non-NULL, it is set to whether a successful parse gave
+// flag_value a different value.
 extern bool TryParseLocked(const CommandLineFlag *flag, FlagValue *flag_value,
-                           const char *value, string *msg);
+                           const char *value, string *msg, bool *changed);
+
+// ------------------------------------------------------------------------
+// 自定义类型
+//    A program can give a flag a type of its own by specializing
+//    FlagTypeTraits for it:
+//
+//      struct Endpoint { string host; int32 port; };
+//      bool operator==(const Endpoint &a, const Endpoint &b);
+//      namespace gflags {
+//      template <> struct FlagTypeTraits<Endpoint> {
+//        static const char *Name() { return "endpoint"; }
+//        static bool Parse(const char *text, Endpoint *value);
+//        static string Format(const Endpoint &value);
+//      };
+//      }
+//      DEFINE_custom(Endpoint, backend, "localhost:8080", "Where to send");
+//
+//    The value is parsed once, when the flag is set, and FLAGS_backend
+//    is a plain Endpoint.  The type also needs a default constructor,
+//    operator= and operator==.  Parse() may leave value half-written on
+//    failure; it is only ever handed scratch copies.
+// ------------------------------------------------------------------------
+
+template <typename FlagType> struct FlagTypeTraits;
+
+// What FlagValue does with a value of type FV_CUSTOM, as functions on
+// untyped pointers.  FlagTypeOpsFor<T>() builds one from FlagTypeTraits.
+struct FlagTypeOps {
+  const char *name; // for type_name()
+  bool (*parse)(const char *text, void *value);
+  string (*format)(const void *value);
+  bool (*equal)(const void *a, const void *b);
+  void (*copy)(void *dst, const void *src);
+  void *(*create)(); // a default-constructed value, for New()
+  void (*destroy)(void *value);
+  // Calls validate_fn, a bool (*)(const char *, const T &).
+  bool (*validate)(ValidateFnProto validate_fn, const char *flagname,
+                   const void *value);
+};
+
+template <typename FlagType> struct FlagTypeOpsImpl {
+  static bool Parse(const char *text, void *value) {
+    return FlagTypeTraits<FlagType>::Parse(text,
+                                           static_cast<FlagType *>(value));
+  }
+  static string Format(const void *value) {
+    return FlagTypeTraits<FlagType>::Format(
+        *static_cast<const FlagType *>(value));
+  }
+  static bool Equal(const void *a, const void *b) {
+    return *static_cast<const FlagType *>(a) ==
+           *static_cast<const FlagType *>(b);
+  }
+  static void Copy(void *dst, const void *src) {
+    *static_cast<FlagType *>(dst) = *static_cast<const FlagType *>(src);
+  }
+  static void *Create() { return new FlagType(); }
+  static void Destroy(void *value) { delete static_cast<FlagType *>(value); }
+  static bool Validate(ValidateFnProto validate_fn, const char *flagname,
+                       const void *value) {
+    // Through void (*)(), which -Wcast-function-type accepts, since this
+    // is compiled with the program's warning flags rather than ours.
+    return reinterpret_cast<bool (*)(const char *, const FlagType &)>(
+        reinterpret_cast<void (*)()>(validate_fn))(
+        flagname, *static_cast<const FlagType *>(value));
+  }
+};
+
+// One FlagTypeOps per type, shared by every flag of that type.
+template <typename FlagType> const FlagTypeOps *FlagTypeOpsFor() {
+  typedef FlagTypeOpsImpl<FlagType> Impl;
+  static const FlagTypeOps ops = {
+      FlagTypeTraits<FlagType>::Name(),
+      Impl::Parse,
+      Impl::Format,
+      Impl::Equal,
+      Impl::Copy,
+      Impl::Create,
+      Impl::Destroy,
+      Impl::Validate,
+  };
+  return &ops;
+}
 
 class FlagValue {
 public:
   template <typename FlagType>
   FlagValue(FlagType *valbuf, bool transfer_ownership_of_value);
+  // A string value that is built from lazy->literal on first access.
+  explicit FlagValue(LazyString *lazy);
+  // An FV_CUSTOM value, handled through ops.
+  FlagValue(void *valbuf, const FlagTypeOps *ops,
+            bool transfer_ownership_of_value);
   ~FlagValue();
 
   bool ParseFrom(const char *spec);
@@ -111,13 +380,18 @@ public:
 
   ValueType Type() const { return static_cast<ValueType>(type_); }
 
+  // Checks the value against a declarative constraint of matching type.
+  bool Satisfies(const FlagConstraint &constraint) const;
+
 private:
   friend class CommandLineFlag; // for many things, including Validate()
   // friend class FlagSaverImpl;   // calls New()
-  friend class FlagRegistry; // checks value_buffer_ for flags_by_ptr_ map
+  friend class FlagRegistry; // checks value_buffer_ for flags_by_ptr_ index
+  friend class FlagView;     // keeps private copies via New(), CopyFrom()
+  friend class AdminServer;  // undoes a failed set the same way
   // template <typename T> friend T GetFromEnv(const char *, T);
   friend bool TryParseLocked(const CommandLineFlag *, FlagValue *, const char *,
-                             string *); // for New(), CopyFrom()
+                             string *, bool *); // for New(), CopyFrom()
 
   const char *TypeName() const;
 
@@ -131,9 +405,20 @@ private:
   // (*validate_fn)(bool) for a bool flag).
   bool Validate(const char *flagname, ValidateFnProto validate_fn_proto) const;
 
-  void *const value_buffer_; // points to the buffer holding our data
-  const int8 type_;          // how to interpret value_
-  const bool owns_value_;    // whether to free value on destruct
+  // Constructs the string of a lazy value, if that hasn't happened yet.
+  // Everything that reads or writes value_buffer_ calls this first.
+  void Materialize() const;
+  // The literal of a lazy value whose string isn't built yet, else NULL.
+  const char *UnbuiltLiteral() const;
+
+  void *const value_buffer_;     // points to the buffer holding our data
+  const int8 type_;              // how to interpret value_
+  const bool owns_value_;        // whether to free value on destruct
+  // Keyed on type_, so that neither costs a word in every FlagValue.
+  union {
+    LazyString *const lazy_;       // FV_STRING: non-NULL for lazy defaults
+    const FlagTypeOps *const ops_; // FV_CUSTOM
+  };
 
   FlagValue(const FlagValue &); // no copying!
   void operator=(const FlagValue &);
@@ -154,11 +439,19 @@ public:
   string default_value() const;
   const char *type_name() const;
   ValidateFnProto validate_function() const;
+  const FlagConstraint *constraint() const;
   const void *flag_ptr() const;
   ValueType Type() const;
-  // If validate_fn_proto_ is non-NULL, calls it on value, returns result.
+  // Checks value against constraint() (if any), then calls
+  // validate_function() on it if that is non-NULL, and returns the result.
   bool Validate(const FlagValue &value) const;
+  // Just the validate_function() half of Validate(), for callers that
+  // have checked the constraint themselves.
+  bool CallValidator(const FlagValue &value) const;
   bool ValidateCurrent() const;
+  // Like Validate(*defvalue_), but the result is memoized until the
+  // default value or the validator changes.
+  bool ValidateDefault() const;
   bool Modified() const;
 
 private:
@@ -167,22 +460,28 @@ private:
   // friend class FlagSaverImpl; // for cloning the values
   // set validate_fn
   friend class Gflags;
+  friend class FlagView; // reads current_
+  friend class AdminServer; // restores current_ after a failed set
+  friend class FlagTable; // sets table_ and index_
 
   // This copies all the non-const members: modified, processed, defvalue, etc.
   void CopyFrom(const CommandLineFlag &src);
   void UpdateModifiedBit();
-
+  void set_modified(bool modified);
+  void set_validate_function(ValidateFnProto validate_fn_proto);
+  // Forget the memoized ValidateDefault() result.  Must be called
+  // whenever defvalue_ or the validator changes.
+  void InvalidateDefaultValidation();
+
+  // Cold metadata only.  The modified bit, validator and constraint are
+  // hot state and live in the registry's FlagTable, at row index_.
   const char *const name_; // Flag name
   const char *const help_; // Help message
-  const char *const file_; // Which file did this come from?
-  bool modified_;          // Set after default assignment?
+  const char *file_;       // Which file?  Interned by RegisterFlag().
   FlagValue *defvalue_;    // Default value for flag
   FlagValue *current_;     // Current value for flag
-  // This is a casted, 'generic' version of validate_fn, which actually
-  // takes a flag-value as an arg (void (*validate_fn)(bool), say).
-  // When we pass this to current_->Validate(), it will cast it back to
-  // the proper type.  This may be NULL to mean we have no validate_fn.
-  ValidateFnProto validate_fn_proto_;
+  FlagTable *table_;       // Set by FlagRegistry::RegisterFlag()
+  uint32 index_;
 
   CommandLineFlag(const CommandLineFlag &); // no copying!
   void operator=(const CommandLineFlag &);
@@ -209,6 +508,10 @@ public:
   void ValidateFlags(bool all);
   void ValidateUnmodifiedFlags();
 
+  // Stage 4: print every error collected by stages 1 and 3 to stderr.
+  // Returns true if there were any.
+  bool ReportErrors();
+
   // Set a particular command line option.  "newval" is a string
   // describing the new value that the option has been set to.  If
   // option_name does not specify a valid option name, or value is not
@@ -223,24 +526,142 @@ public:
 private:
   const Gflags *const enter_;
   FlagRegistry *const registry_;
-  map<string, string> error_flags_; // map from name to error message
+  uint64 batch_; // the commandline's batch, once parsed; see ValidateFlags()
+  map<string, string> error_flags_; // flag or "constraint:" name -> message
   // This could be a set<string>, but we reuse the map to minimize the .o size
   map<string, string> undefined_names_; // --[flag] name was not registered
 };
 
+// --------------------------------------------------------------------
+// FlagTable
+//    The per-flag state that full-registry walks such as ValidateFlags()
+//    look at, kept in dense parallel arrays indexed by
+//    CommandLineFlag::index_ (registration order).  Everything else
+//    about a flag (name, help, file, its FlagValues) stays in the
+//    CommandLineFlag, which a walk only dereferences for the few flags
+//    whose state says there is something to check.
+// --------------------------------------------------------------------
+class FlagTable {
+public:
+  // Bits of state_.
+  enum {
+    kModified = 1 << 0,       // set after default assignment
+    kChecked = 1 << 1,        // has a validator or a constraint
+    kDefaultValid = 1 << 2,   // memoized verdict on the default value;
+    kDefaultInvalid = 1 << 3, // neither bit means not computed yet
+  };
+
+  // Adds a row for flag and points flag->table_ and flag->index_ at it.
+  void Append(CommandLineFlag *flag, const FlagConstraint *constraint);
+
+  uint32 size() const { return static_cast<uint32>(flags_.size()); }
+
+private:
+  friend class CommandLineFlag;       // reads and writes its own row
+  friend class CommandLineFlagParser; // walks state_ in ValidateFlags()
+  friend class FlagRegistry;          // points stats_ at its counters
+
+  // Hot: one byte per flag is all a walk needs for unchecked flags.
+  vector<uint8> state_;
+  // Warm: only read for rows with kChecked set.
+  // validate_fn_ is a casted, 'generic' version of validate_fn, which
+  // actually takes a flag-value as an arg (void (*validate_fn)(bool),
+  // say).  FlagValue::Validate() casts it back to the proper type.
+  // NULL means the flag has no validate_fn.
+  vector<ValidateFnProto> validate_fn_;
+  vector<const FlagConstraint *> constraint_;
+  // Cold: back-pointers to the rest of each flag.
+  vector<CommandLineFlag *> flags_;
+
+#if defined(GFLAGS_ENABLE_STATS)
+  RegistryStats *stats_; // the owning registry's, for validator calls
+#endif
+};
+
+// FlagSuggester
+//    A BK-tree over flag names under Levenshtein distance, for "did you
+//    mean" hints.  Every child of a node hangs off an edge labelled with
+//    its distance to the node, so by the triangle inequality a search
+//    within distance r of the query only descends the edges within r of
+//    the query's own distance to the node.
+class FlagSuggester {
+public:
+  // A lookup gives up after visiting this many nodes, or after this
+  // long, whichever comes first, so that a long commandline full of
+  // typos stays linear in its length.
+  static const size_t kMaxVisits = 4096;
+  static const uint64 kMaxLookupNanos = 200 * 1000;
+
+  bool empty() const { return nodes_.empty(); }
+
+  // Adds name, which must outlive the suggester.
+  void Add(const char *name);
+
+  // Sets output to the names at the smallest edit distance from name,
+  // at most max_results of them in name order, or clears it if none is
+  // close enough to be a plausible typo.
+  void Suggest(const char *name, size_t max_results,
+               vector<const char *> *output) const;
+
+  static size_t EditDistance(const char *a, const char *b);
+
+private:
+  struct Node {
+    const char *name;
+    size_t distance;    // to the parent
+    int32 first_child;  // -1 if none
+    int32 next_sibling; // -1 if none
+  };
+  vector<Node> nodes_; // nodes_[0] is the root
+};
+
+// Locking
+//    lock_ guards the registry's structure: the flags_ map, the table,
+//    the pointer index and the cross-flag constraints.  Shard locks
+//    guard flag values; shard i covers the flags with
+//    index_ % kNumShards == i.
+//
+//    - Registering flags, validators and constraints, batches,
+//      ValidateFlags() and FlagView hold lock_ exclusively.  That
+//      excludes every shard user, so they take no shard locks.
+//    - Getting or setting one flag holds lock_ shared, plus its shards
+//      through FlagShardLock: ShardBit(flag) shared to read the value,
+//      SetShardMaskLocked(flag) exclusive to set it.  So sets of
+//      unrelated flags in different shards do not contend.
+//
+//    Lock order: lock_ first, then shards in ascending index.  Never
+//    wait for lock_ while holding a shard.  A FooLocked() method needs
+//    lock_ held in one of these two ways.
 class FlagRegistry {
 public:
   FlagRegistry();
   ~FlagRegistry();
 
+  // shards_ is cache-line aligned, which C++11's plain new does not
+  // honour on the heap.
+  static void *operator new(size_t size);
+  static void operator delete(void *p);
+
   static FlagRegistry *GlobalRegistry(); // returns a singleton registry
   static void DeleteGlobalRegistry();
 
   void Lock();
   void Unlock();
+  // Shared holds, for single-flag operations; see "Locking" above.
+  void ReaderLock();
+  void ReaderUnlock();
+
+  // Shard masks for FlagShardLock; bit i stands for shard i.  Reading
+  // flag needs ShardBit(flag).  Setting it needs SetShardMaskLocked(flag),
+  // which adds the shards of every flag in a cross-flag constraint that
+  // reads it, since SetFlagLocked() evaluates those too.
+  static uint32 ShardBit(const CommandLineFlag *flag);
+  uint32 SetShardMaskLocked(const CommandLineFlag *flag) const;
 
   // Store a flag in this registry.  Takes ownership of the given pointer.
-  void RegisterFlag(CommandLineFlag *flag);
+  // constraint, if any, must outlive the registry.
+  void RegisterFlag(CommandLineFlag *flag,
+                    const FlagConstraint *constraint = NULL);
 
   // Returns the flag object for the specified name, or NULL if not found.
   CommandLineFlag *FindFlagLocked(const char *name);
@@ -249,21 +670,61 @@ public:
   // That is, for whom current_->value_buffer_ == flag_ptr
   CommandLineFlag *FindFlagViaPtrLocked(const void *flag_ptr);
 
+  // Appends the flags whose names match the fnmatch() pattern to output,
+  // in name order.  The literal prefix of pattern, up to its first
+  // wildcard, is looked up as a range of flags_, so "rpc_*" costs
+  // O(log n + k) and only the flags in that range go through fnmatch().
+  // A pattern with no wildcard, or just a trailing '*', needs no
+  // fnmatch() at all.  Needs lock_, shared is enough.
+  void GetFlagsMatchingLocked(const char *pattern,
+                              vector<const CommandLineFlag *> *output) const;
+
   // A fancier form of FindFlag that works correctly if name is of the
   // form flag=value.  In that case, we set key to point to flag, and
   // modify v to point to the value (if present), and return the flag
   // with the given name.  If the flag does not exist, returns NULL
-  // and sets error_message.
+  // and sets error_message, which names the closest flags if there
+  // are any.  Needs lock_ exclusively, since the first unknown flag
+  // builds suggester_.
   CommandLineFlag *SplitArgumentLocked(const char *argument, string *key,
                                        const char **v, string *error_message);
 
-  // Set the value of a flag.  If the flag was successfully set to
-  // value, set msg to indicate the new flag-value, and return true.
-  // Otherwise, set msg to indicate the error, leave flag unchanged,
-  // and return false.  msg can be NULL.
+  // Set the value of a flag.  Needs lock_ exclusively, or lock_ shared
+  // plus SetShardMaskLocked(flag) exclusively.  If the flag was
+  // successfully set to value, set msg to indicate the new flag-value,
+  // and return true.  Otherwise, set msg to indicate the error, leave
+  // flag unchanged, and return false.  msg can be NULL.
+  //   Outside a batch, the cross-flag constraints that read flag are
+  // evaluated as part of the same commit; if one fails, the flag is
+  // rolled back and false is returned.
   bool SetFlagLocked(CommandLineFlag *flag, const char *value,
                      FlagSettingMode set_mode, string *msg);
 
+  // Bumped by every SetFlagLocked() that commits a new value, so that
+  // readers such as FlagView can tell cheaply whether any flag changed.
+  uint64 generation() const {
+    return generation_.load(std::memory_order_relaxed);
+  }
+
+  // Store a cross-flag constraint.  Takes ownership of the given pointer.
+  void RegisterCrossFlagConstraintLocked(CrossFlagConstraint *constraint);
+
+  // A batch groups several SetFlagLocked() calls, such as all the flags
+  // on a commandline, so that constraints may be violated in between
+  // (--min_conns=50 before --max_conns=100).  EndBatchLocked() evaluates
+  // every constraint touched by the batch once, adds a
+  // (constraint name, error message) pair to errors for each failure, and
+  // returns true if there were none.  Failed batches are not rolled back.
+  // BeginBatchLocked() returns the batch's number, which is never 0 and
+  // is stored in the checked_batch of every constraint it evaluates.
+  uint64 BeginBatchLocked();
+  bool EndBatchLocked(vector<std::pair<string, string> > *errors);
+
+  // Copies this registry's counters, and those of its lock, into stats.
+  // Sets stats->enabled to false and leaves everything else zero unless
+  // the library was built with GFLAGS_ENABLE_STATS.
+  void GetStats(FlagStats *stats) const;
+
 private:
   // friend class FlagSaverImpl;         // reads all the flags in order
   //                                     // to copy them
@@ -275,14 +736,76 @@ private:
   typedef FlagMap::const_iterator FlagConstIterator;
   FlagMap flags_;
 
-  // The map from current-value pointer to flag, fo FindFlagViaPtrLocked().
-  typedef map<const void *, CommandLineFlag *> FlagPtrMap;
-  FlagPtrMap flags_by_ptr_;
+  FlagTable table_;
+
+  // Index from current-value pointer to flag, fo FindFlagViaPtrLocked().
+  // A vector sorted on first use is a quarter of the size of a map, and
+  // it is only searched when validators and views are registered.
+  typedef std::pair<const void *, CommandLineFlag *> FlagPtrEntry;
+  vector<FlagPtrEntry> flags_by_ptr_;
+  bool flags_by_ptr_sorted_;
+
+  // All cross-flag constraints, and the dependency index from each flag
+  // to the constraints that read it.
+  typedef vector<CrossFlagConstraint *> CrossFlagConstraints;
+  typedef map<const CommandLineFlag *, CrossFlagConstraints> ConstraintIndex;
+  CrossFlagConstraints cross_constraints_;
+  ConstraintIndex constraints_by_flag_;
+  bool batch_open_;
+  uint64 batches_; // BeginBatchLocked() calls so far
+  CrossFlagConstraints batch_pending_; // constraints touched by the batch
+
+  // Does the work of SetFlagLocked(), minus cross-flag constraints and
+  // the generation bump.  Sets *changed to whether the flag's current or
+  // default value changed.
+  bool ApplyFlagLocked(CommandLineFlag *flag, const char *value,
+                       FlagSettingMode set_mode, string *msg, bool *changed);
+
+  // Runs constraint's validator.
+  bool CheckCrossConstraintLocked(const CrossFlagConstraint *constraint);
 
   static FlagRegistry *global_registry_; // a singleton registry
 
   Mutex lock_;
 
+  friend class FlagShardLock;
+  static const uint32 kNumShards = 16;
+  struct Shard {
+    Mutex lock;
+  } __attribute__((aligned(GFLAGS_CACHELINE_SIZE)));
+  Shard shards_[kNumShards];
+
+  std::atomic<uint64> generation_; // see generation()
+
+#if defined(GFLAGS_ENABLE_STATS)
+  RegistryStats stats_; // see GetStats()
+#endif
+
+  // The flags defined in one file, the per-file index that reports
+  // select from.
+  struct FlagFile {
+    const char *name;                // canonical copy of the path
+    vector<CommandLineFlag *> flags; // in registration order
+  };
+
+  // Returns the entry for filename, creating it on first use, so that
+  // flags defined in the same file share one name pointer and can be
+  // grouped by address.  All flags of a translation unit already pass
+  // the same __FILE__ literal, so the path itself is only read once per
+  // file.
+  FlagFile *InternFileLocked(const char *filename);
+
+  typedef map<const char *, FlagFile *> FileAddressMap;
+  typedef map<const char *, FlagFile, StringCmp> FileNameMap;
+  FileAddressMap files_by_address_; // any __FILE__ literal -> file
+  FileNameMap files_;               // path -> file, in path order
+
+  // " (did you mean --x?)" for an unknown flag name, or "".
+  string SuggestFlagsLocked(const char *name);
+
+  // Empty until the first unknown flag; kept up to date after that.
+  FlagSuggester suggester_;
+
   static void InitGlobalRegistry();
 
   // Disallow
@@ -299,6 +822,76 @@ private:
   FlagRegistry *const fr_;
 };
 
+class FlagRegistryReaderLock {
+public:
+  explicit FlagRegistryReaderLock(FlagRegistry *fr);
+  ~FlagRegistryReaderLock();
+
+private:
+  FlagRegistry *const fr_;
+};
+
+// Holds the shards in mask (see FlagRegistry::ShardBit()) for its
+// scope, exclusively or shared.  The caller must already hold the
+// registry lock shared.
+class FlagShardLock {
+public:
+  FlagShardLock(FlagRegistry *fr, uint32 mask, bool exclusive);
+  ~FlagShardLock();
+
+private:
+  FlagRegistry *const fr_;
+  const uint32 mask_;
+  const bool exclusive_;
+};
+
+// ------------------------------------------------------------------------
+// 注册耗时
+//    With GFLAGS_PROFILE_REGISTRATION, every RegisterCommandLineFlag()
+//    records which file defined the flag, when, and how long registering
+//    it took, so that a library that slows down static initialization
+//    with thousands of flags can be found.  See
+//    Gflags::GetRegistrationCostByFile().
+// ------------------------------------------------------------------------
+struct FlagRegistrationRecord {
+  const char *filename; // of the DEFINE_*
+  const void *storage;  // FLAGS_<name>; tells which shared object it is in
+  uint64 start_ns;      // CLOCK_MONOTONIC
+  uint64 duration_ns;
+};
+
+struct FlagRegistrationCost {
+  string name; // a filename or the path of a shared object
+  uint32 flags;
+  uint64 total_ns;
+  uint64 first_ns; // start_ns of the first and the last registration
+  uint64 last_ns;
+};
+
+extern void RecordFlagRegistration(const FlagRegistrationRecord &record);
+
+#if defined(GFLAGS_PROFILE_REGISTRATION)
+class RegistrationTimer {
+public:
+  RegistrationTimer(const char *filename, const void *storage) {
+    record_.filename = filename;
+    record_.storage = storage;
+    record_.start_ns = MonotonicNanos();
+  }
+  ~RegistrationTimer() {
+    record_.duration_ns = MonotonicNanos() - record_.start_ns;
+    RecordFlagRegistration(record_);
+  }
+
+private:
+  FlagRegistrationRecord record_;
+};
+#define GFLAGS_REGISTRATION_TIMER(filename, storage)                           \
+  gflags::RegistrationTimer registration_timer(filename, storage)
+#else
+#define GFLAGS_REGISTRATION_TIMER(filename, storage) ((void)0)
+#endif
+
 // ------------------------------------------------------------------------
 // 全局管理
 // ------------------------------------------------------------------------
@@ -319,10 +912,12 @@ public:
   // 对于string类型可能会有bug(DEFINE_string
   // http://code.google.com/p/google-gflags/issues/detail?id=20)
   template <typename FlagType>
-  static bool RegisterCommandLineFlag(const char *name, const char *help,
-                                      const char *filename,
-                                      FlagType *current_storage,
-                                      FlagType *defvalue_storage) {
+  static bool
+  RegisterCommandLineFlag(const char *name, const char *help,
+                          const char *filename, FlagType *current_storage,
+                          FlagType *defvalue_storage,
+                          const FlagConstraint *constraint = NULL) {
+    GFLAGS_REGISTRATION_TIMER(filename, current_storage);
     if (help == NULL)
       help = "";
 
@@ -333,10 +928,52 @@ public:
         new CommandLineFlag(name, help, filename, current, defvalue);
     if (!flag)
       return false;
-    FlagRegistry::GlobalRegistry()->RegisterFlag(flag); // default registry
+    // default registry
+    FlagRegistry::GlobalRegistry()->RegisterFlag(flag, constraint);
+    return true;
+  }
+
+  // Registers a validator over several flags; see DEFINE_cross_validator.
+  // Returns false if one of flag_ptrs is not a flag.
+  static bool RegisterCrossFlagValidator(const char *name,
+                                         CrossFlagValidateFn validate_fn,
+                                         const void *const *flag_ptrs,
+                                         size_t num_flags);
+
+  // DEFINE_custom.
+  template <typename FlagType>
+  static bool RegisterCustomCommandLineFlag(const char *name, const char *help,
+                                            const char *filename,
+                                            FlagType *current_storage,
+                                            FlagType *defvalue_storage) {
+    GFLAGS_REGISTRATION_TIMER(filename, current_storage);
+    if (help == NULL)
+      help = "";
+
+    const FlagTypeOps *const ops = FlagTypeOpsFor<FlagType>();
+    FlagValue *const current = new FlagValue(current_storage, ops, false);
+    FlagValue *const defvalue = new FlagValue(defvalue_storage, ops, false);
+    CommandLineFlag *flag =
+        new CommandLineFlag(name, help, filename, current, defvalue);
+    FlagRegistry::GlobalRegistry()->RegisterFlag(flag);
     return true;
   }
 
+  // DEFINE_string with GFLAGS_LAZY_STRING_DEFAULTS.
+  static bool RegisterCommandLineFlag(const char *name, const char *help,
+                                      const char *filename,
+                                      clstring *current_storage,
+                                      LazyString *defvalue_storage,
+                                      const FlagConstraint *constraint = NULL);
+
+  // Every registration so far, in order, and the same summed per
+  // defining file or per shared object, costliest first.  These are
+  // empty unless built with GFLAGS_PROFILE_REGISTRATION.
+  static void GetRegistrationProfile(vector<FlagRegistrationRecord> *output);
+  static void GetRegistrationCostByFile(vector<FlagRegistrationCost> *output);
+  static void
+  GetRegistrationCostByObject(vector<FlagRegistrationCost> *output);
+
   // --------------------------------------------------------------------
   // RegisterFlagValidator()
   //    RegisterFlagValidator() is the function that clients use to
@@ -374,7 +1011,7 @@ public:
            << "': validate-fn already registered";
       return false;
     } else {
-      flag->validate_fn_proto_ = validate_fn_proto;
+      flag->set_validate_function(validate_fn_proto);
       return true;
     }
   }
@@ -395,6 +1032,46 @@ public:
 
   bool GetCommandLineOption(const char *name, string *value);
 
+  // Set the value of the named flag at runtime.  Returns a message
+  // describing the new value, or the empty string if the flag does not
+  // exist, the value does not parse, or a validator or constraint
+  // rejects it (in which case the flag is unchanged).
+  string SetCommandLineOption(const char *name, const char *value);
+  string SetCommandLineOptionWithMode(const char *name, const char *value,
+                                      FlagSettingMode set_mode);
+
+  // Appends one entry per flag that was defined with a declarative
+  // constraint, sorted by flag name.
+  void GetFlagConstraints(vector<FlagConstraintInfo> *output);
+
+  // A snapshot of the global registry's operation counters and latency
+  // histograms; see gflags_stats.h.  All zero, with enabled false,
+  // unless the library was built with GFLAGS_ENABLE_STATS.
+  FlagStats GetStats();
+
+  // Appends the flags whose names match the fnmatch() pattern, such as
+  // "rpc_*", to output in name order.  These point into the registry
+  // instead of copying each flag; they stay valid until
+  // ShutDownCommandLineFlags().  Their names, types and help can be read
+  // freely, but read values through GetCommandLineOption(name): calling
+  // current_value() on them takes no lock, and races with any set.
+  void GetFlagsMatching(const char *pattern,
+                        vector<const CommandLineFlag *> *output);
+
+  // Writes "program: usage" and then the help for every flag defined in
+  // a file whose path contains restrict, grouped by file, to fd.  With
+  // module set, restrict must instead name the file: "foo" selects
+  // foo.cc and dir/foo.cc, but not foobar.cc.  An empty restrict
+  // selects everything.
+  void ShowUsageWithFlagsRestrict(int fd, const char *restrict,
+                                  bool module = false);
+  void ShowVersion(int fd);
+
+  // Handles --help, --helpfull, --helpon, --helpmatch and --version:
+  // if any of them is set, prints the report and exits.  Called by
+  // ParseCommandLineFlags().
+  void HandleCommandLineHelpFlags();
+
   void ShutDownCommandLineFlags();
 
 private:
@@ -410,6 +1087,305 @@ private:
   string version_string;
 };
 
+// ------------------------------------------------------------------------
+// FlagView
+//    Private, typed copies of a few flags for hot loops.  Reading a copy
+//    never touches the shared FLAGS_* storage or the registry lock;
+//    Sync() compares the registry's generation with the one the copies
+//    were taken at (a single relaxed load) and only re-copies, under the
+//    lock, when some flag has been set since:
+//
+//      static thread_local FlagView view;
+//      static thread_local const int32 *batch = view.Track(FLAGS_batch);
+//      for (;;) {
+//        view.Sync();  // once per batch of packets
+//        ... *batch ...
+//      }
+//
+//    A FlagView is not thread-safe; give each thread its own, typically
+//    thread_local.  Writes that bypass the flags API (FLAGS_x = 1) don't
+//    bump the generation and are only picked up with the next set.
+// ------------------------------------------------------------------------
+class FlagView {
+public:
+  FlagView(); // views the global registry
+  ~FlagView();
+
+  // Starts caching the given flag.  The returned copy stays valid for the
+  // life of the view and is refreshed by Sync().
+  template <typename FlagType> const FlagType *Track(const FlagType &flag) {
+    return static_cast<const FlagType *>(TrackFlag(&flag));
+  }
+
+  void Sync() {
+    if (registry_->generation() != generation_)
+      Refresh();
+  }
+
+private:
+  const void *TrackFlag(const void *flag_ptr);
+  void Refresh();
+  void RefreshLocked();
+
+  FlagRegistry *const registry_;
+  uint64 generation_; // registry generation the copies were taken at
+  vector<std::pair<const CommandLineFlag *, FlagValue *> > copies_;
+
+  FlagView(const FlagView &); // no copying!
+  void operator=(const FlagView &);
+};
+
+// ------------------------------------------------------------------------
+// 共享内存
+//    Flag values shared by a group of processes through a named POSIX
+//    shared-memory segment.  An admin process publishes the flags it
+//    wants to share; each worker attaches and calls Sync() where it
+//    would read them, say once per request:
+//
+//      // admin                            // each worker
+//      SharedFlagSegment seg;              SharedFlagSegment seg;
+//      seg.Create(&gflags, "/app",         seg.Attach("/app", &error);
+//                 "rpc_*", &error);        for (;;) {
+//      ...                                   seg.Sync(&gflags);
+//      seg.Set("rpc_timeout", "250");        HandleRequest();
+//                                          }
+//
+//    The FLAGS_* variables stay where they are, private to each process;
+//    the segment holds the text of each value, and Sync() copies changed
+//    values into the process through SetCommandLineOption(), so
+//    validators run as usual and FlagView sees the change.  When nothing
+//    has changed, Sync() is a single atomic load.
+//      Every value is guarded by a sequence lock, so no process ever
+//    waits on another to read, and a process that dies mid-read holds
+//    nothing up.
+// ------------------------------------------------------------------------
+
+class SharedFlagSegment {
+public:
+  // The longest flag name and value, in bytes, a segment can hold.
+  static const size_t kMaxNameLength = 63;
+  static const size_t kMaxValueLength = 255;
+
+  SharedFlagSegment();
+  ~SharedFlagSegment(); // unmaps the segment; see Unlink()
+
+  // Creates the segment name, such as "/app_flags", replacing any old
+  // one, holding the flags that match the fnmatch() pattern with their
+  // current values.  Fails if a value is longer than kMaxValueLength.
+  bool Create(Gflags *gflags, const char *name, const char *pattern,
+              string *error);
+  // Maps the segment another process created.
+  bool Attach(const char *name, string *error);
+  // Removes the name; processes that have the segment mapped keep it.
+  static bool Unlink(const char *name);
+
+  // Stores value as the shared value of flag name.  The value is not
+  // checked here: each worker parses it, and one that rejects it keeps
+  // its old value.  False if the flag is not in the segment or the value
+  // is too long.
+  bool Set(const char *name, const char *value);
+  // Reads the shared value of flag name.
+  bool Get(const char *name, string *value) const;
+
+  // Applies every shared value that changed since the last Sync() to
+  // the process's own flags; the first call applies them all.  Returns
+  // the number of values applied, and appends the names of the flags
+  // whose new value was rejected to rejected, if given.
+  size_t Sync(Gflags *gflags, vector<string> *rejected = NULL);
+
+  // Counts calls to Set(), from any process.
+  uint64 generation() const;
+
+  // The layout of the segment; see gflags_shared.cc.
+  struct Header;
+  struct Slot;
+
+private:
+  bool Map(int fd, size_t size, string *error);
+  const Slot *FindSlot(const char *name) const;
+
+  Header *header_;
+  size_t size_;
+  uint64 synced_generation_;
+  vector<uint32> synced_seq_; // per slot, as of the last Sync()
+
+  SharedFlagSegment(const SharedFlagSegment &);
+  void operator=(const SharedFlagSegment &);
+};
+
+// ------------------------------------------------------------------------
+// 管理接口
+//    An optional admin endpoint on a Unix domain socket, for reading and
+//    changing the flags of a live process:
+//
+//      AdminServer admin;
+//      admin.Start("/run/app/flags.sock", &error);
+//
+//      $ socat - UNIX-CONNECT:/run/app/flags.sock
+//      get rpc_timeout rpc_retries
+//      rpc_timeout=100
+//      rpc_retries=3
+//      OK
+//      set rpc_timeout=250 rpc_retries=5
+//      OK
+//
+//    A command is a line of words separated by spaces, so a value cannot
+//    contain one.  Every reply ends with "OK" or "ERR <message>".
+//      get NAME...         NAME=VALUE for each flag.
+//      set NAME=VALUE...   Sets the flags as one batch: cross-flag
+//                          constraints are checked once, after all of
+//                          them.  If a name is unknown, a value does not
+//                          parse or a constraint fails, none is set.
+//      list [PATTERN]      NAME=VALUE for each flag matching the fnmatch()
+//                          pattern, or for every flag.
+//      watch PATTERN       NAME=VALUE for each matching flag, "OK", and
+//                          then NAME=VALUE each time one of them is set
+//                          through the registry, until the client hangs
+//                          up.  Replaces the connection's earlier watch.
+//
+//    A single thread serves every client with non-blocking sockets, so a
+//    slow or stuck client holds up nobody but itself.  It holds the
+//    registry lock shared to read values, and exclusively only for the
+//    commit of one set batch; code reading FLAGS_* never waits for it.
+//    The socket is created mode 0600.  Stop the server before
+//    ShutDownCommandLineFlags().
+// ------------------------------------------------------------------------
+
+class AdminServer {
+public:
+  AdminServer();
+  ~AdminServer(); // calls Stop()
+
+  // Listens on path, replacing a socket file nobody listens on any
+  // more, and starts the server thread.  Fails if path exists and is
+  // not a socket.
+  bool Start(const char *path, string *error);
+  // Closes every connection, joins the thread and removes the socket.
+  void Stop();
+
+  // The state of one client; see gflags_admin.cc.
+  struct Connection;
+
+private:
+  static void *ThreadMain(void *arg);
+  void Run();
+  void Accept();
+  void ResumeAccept();
+  // These return false if they closed the connection.
+  bool Read(Connection *conn);
+  bool Write(Connection *conn);
+  void Close(Connection *conn);
+  void Execute(Connection *conn, const string &line);
+  static void CommandSet(const vector<string> &words, string *reply);
+  // Sends watchers the flags that changed since the last call.
+  void PollWatches();
+
+  string path_;
+  int listen_fd_;
+  int epoll_fd_;
+  int wake_fd_; // eventfd that tells the thread to exit
+  pthread_t thread_;
+  bool running_;
+  bool accept_paused_; // listen_fd_ is out of the epoll set; see Accept()
+  map<int, Connection *> connections_; // by fd; server thread only
+  size_t watchers_;                    // connections with a watch
+  uint64 watch_generation_;            // registry generation last polled
+
+  AdminServer(const AdminServer &);
+  void operator=(const AdminServer &);
+};
+
+// ------------------------------------------------------------------------
+// 线程局部覆盖
+// ------------------------------------------------------------------------
+
+// One entry in the calling thread's stack of flag overrides.  The stack
+// is an intrusive list threaded through the ScopedFlagOverride objects
+// themselves, so pushing and popping is O(1), never allocates, and never
+// touches the FlagRegistry or its lock.
+class FlagOverride {
+public:
+  // True if the calling thread has any override in effect.
+  static bool Active() { return top_ != NULL; }
+
+  // Returns the innermost override of the flag stored at flag_ptr on the
+  // calling thread, or NULL if there is none.
+  static const void *Find(const void *flag_ptr);
+
+protected:
+  FlagOverride(const void *flag_ptr, const void *value)
+      : flag_ptr_(flag_ptr), value_(value), prev_(top_) {
+    top_ = this;
+  }
+  ~FlagOverride() {
+    assert(top_ == this); // scopes must nest
+    top_ = prev_;
+  }
+
+private:
+  const void *const flag_ptr_; // &FLAGS_name
+  const void *const value_;    // the overriding value, same type
+  FlagOverride *const prev_;
+
+  // __thread rather than thread_local: it is constant-initialized and
+  // trivially destructible, so reading it from another translation unit
+  // needs no TLS init wrapper, just the load.
+  static __thread FlagOverride *top_;
+
+  FlagOverride(const FlagOverride &); // no copying!
+  void operator=(const FlagOverride &);
+};
+
+// Overrides a flag for the calling thread until the end of the scope,
+// without changing FLAGS_name for other threads:
+//   ScopedFlagOverride<bool> canary(FLAGS_use_new_backend, true);
+// Only reads made through GetFlag() see the override.
+template <typename FlagType> class ScopedFlagOverride : public FlagOverride {
+public:
+  // flag is taken by non-const reference, so that FLAGS_name of another
+  // type fails to compile instead of binding to a converted temporary,
+  // whose address no read would ever match.
+  ScopedFlagOverride(FlagType &flag, const FlagType &value)
+      : FlagOverride(&flag, &value_), value_(value) {}
+
+private:
+  const FlagType value_;
+};
+
+// Reads a flag through the calling thread's overrides, eg
+//   if (GetFlag(FLAGS_use_new_backend)) ...
+// With no override active on the thread this costs one thread-local load
+// and a well-predicted branch on top of reading FLAGS_name directly.
+template <typename FlagType>
+inline const FlagType &GetFlag(const FlagType &flag) {
+  if (!FlagOverride::Active())
+    return flag;
+  const void *value = FlagOverride::Find(&flag);
+  return value ? *static_cast<const FlagType *>(value) : flag;
+}
+// GetFlag<int64>(FLAGS_some_int32) would read a converted temporary.
+template <typename FlagType>
+const FlagType &GetFlag(const FlagType &&) = delete;
+
+// Where the DEFINE_* macros keep help text.  By default it is an ordinary
+// string.  Building with GFLAGS_COLD_HELP packs every help string into
+// the read-only section gflags_help instead, away from the rodata the
+// program actually uses, so those pages are only faulted in when usage
+// output reads them (help must then be a string literal).  Building with
+// GFLAGS_STRIP_HELP leaves help text out of the binary altogether.
+#if defined(GFLAGS_STRIP_HELP)
+#define GFLAGS_DEFINE_HELP(name, help) static_assert(true, "")
+#define GFLAGS_HELP(name, help) gflags::kStrippedFlagHelp
+#elif defined(GFLAGS_COLD_HELP)
+#define GFLAGS_DEFINE_HELP(name, help)                                         \
+  static const char name##_flag_help[]                                         \
+      __attribute__((section("gflags_help"), aligned(1))) = help
+#define GFLAGS_HELP(name, help) name##_flag_help
+#else
+#define GFLAGS_DEFINE_HELP(name, help) static_assert(true, "")
+#define GFLAGS_HELP(name, help) help
+#endif
+
 // Each command-line flag has two variables associated with it: one
 // with the current value, and one with the default value.  However,
 // we have a third variable, which is where value is assigned; it's a
@@ -427,8 +1403,10 @@ private:
   /* We always want to export defined variables, dll or no */                  \
   type FLAGS_##name = value;                                                   \
   static type FLAGS_no##name = value;                                          \
+  GFLAGS_DEFINE_HELP(name, help);                                              \
   static const bool name##_flag_registered = Gflags::RegisterCommandLineFlag(  \
-      #name, help, __FILE__, &FLAGS_##name, &FLAGS_no##name);                  \
+      #name, GFLAGS_HELP(name, help), __FILE__, &FLAGS_##name,                 \
+      &FLAGS_no##name);                                                        \
   }                                                                            \
   using gflags::FLAGS_##name
 
@@ -451,6 +1429,110 @@ private:
 
 #define DEFINE_double(name, val, help) DEFINE_VARIABLE(double, name, val, help)
 
+// DEFINE_hot_* flags are for values read on hot paths.  Their FLAGS_name
+// storage goes in the dedicated section gflags_hot, and each one fills a
+// cache line of its own: it is aligned to the line, and padded to the
+// end of it, so the linker can never place a frequently written global
+// on the same line, even after the last hot flag of the section, and
+// cause false sharing with the readers.  The cost is a cache line of
+// .data per flag.
+//   The padded line is a HotFlagStorage, and FLAGS_name an alias of its
+// value, so FLAGS_name is still a plain variable of the flag's type.
+template <typename T> union HotFlagStorage {
+  static_assert(sizeof(T) <= GFLAGS_CACHELINE_SIZE, "hot flag too large");
+  T value;
+  char line[GFLAGS_CACHELINE_SIZE];
+};
+
+#define GFLAGS_HOT_STORAGE                                                     \
+  __attribute__((section("gflags_hot"), aligned(GFLAGS_CACHELINE_SIZE), used))
+
+#define DEFINE_HOT_VARIABLE(type, name, value, help)                           \
+  namespace gflags {                                                           \
+  using gflags::Gflags;                                                        \
+  static HotFlagStorage<type> hot_storage_##name __asm__(                      \
+      "gflags_hot_" #name) GFLAGS_HOT_STORAGE = {value};                       \
+  extern type FLAGS_##name __attribute__((alias("gflags_hot_" #name)));        \
+  static type FLAGS_no##name = value;                                          \
+  GFLAGS_DEFINE_HELP(name, help);                                              \
+  static const bool name##_flag_registered = Gflags::RegisterCommandLineFlag(  \
+      #name, GFLAGS_HELP(name, help), __FILE__, &FLAGS_##name,                 \
+      &FLAGS_no##name);                                                        \
+  }                                                                            \
+  using gflags::FLAGS_##name
+
+#define DEFINE_hot_bool(name, val, help)                                       \
+  DEFINE_HOT_VARIABLE(bool, name, val, help)
+
+#define DEFINE_hot_int32(name, val, help)                                      \
+  DEFINE_HOT_VARIABLE(gflags::int32, name, val, help)
+
+#define DEFINE_hot_uint32(name, val, help)                                     \
+  DEFINE_HOT_VARIABLE(gflags::uint32, name, val, help)
+
+#define DEFINE_hot_int64(name, val, help)                                      \
+  DEFINE_HOT_VARIABLE(gflags::int64, name, val, help)
+
+#define DEFINE_hot_uint64(name, val, help)                                     \
+  DEFINE_HOT_VARIABLE(gflags::uint64, name, val, help)
+
+#define DEFINE_hot_double(name, val, help)                                     \
+  DEFINE_HOT_VARIABLE(double, name, val, help)
+
+// Like DEFINE_VARIABLE, but also stores a FlagConstraint next to the flag.
+// The constraint is checked inline whenever the flag is set.  An empty
+// range, or a default value outside the constraint, is fatal at
+// registration.
+#define DEFINE_CONSTRAINED_VARIABLE(type, name, value, constraint, help)       \
+  namespace gflags {                                                           \
+  using gflags::Gflags;                                                        \
+  type FLAGS_##name = value;                                                   \
+  static type FLAGS_no##name = value;                                          \
+  static const gflags::FlagConstraint name##_flag_constraint = constraint;     \
+  GFLAGS_DEFINE_HELP(name, help);                                              \
+  static const bool name##_flag_registered = Gflags::RegisterCommandLineFlag(  \
+      #name, GFLAGS_HELP(name, help), __FILE__, &FLAGS_##name,                 \
+      &FLAGS_no##name, &name##_flag_constraint);                               \
+  }                                                                            \
+  using gflags::FLAGS_##name
+
+// Range-constrained numeric flags: lo <= FLAGS_name <= hi always holds
+// for values set through the flags API.
+#define DEFINE_int32_range(name, val, lo, hi, help)                            \
+  DEFINE_CONSTRAINED_VARIABLE(gflags::int32, name, val,                        \
+                              gflags::FlagConstraint::IntRange(lo, hi), help)
+
+#define DEFINE_uint32_range(name, val, lo, hi, help)                           \
+  DEFINE_CONSTRAINED_VARIABLE(gflags::uint32, name, val,                       \
+                              gflags::FlagConstraint::UintRange(lo, hi), help)
+
+#define DEFINE_int64_range(name, val, lo, hi, help)                            \
+  DEFINE_CONSTRAINED_VARIABLE(gflags::int64, name, val,                        \
+                              gflags::FlagConstraint::IntRange(lo, hi), help)
+
+#define DEFINE_uint64_range(name, val, lo, hi, help)                           \
+  DEFINE_CONSTRAINED_VARIABLE(gflags::uint64, name, val,                       \
+                              gflags::FlagConstraint::UintRange(lo, hi), help)
+
+#define DEFINE_double_range(name, val, lo, hi, help)                           \
+  DEFINE_CONSTRAINED_VARIABLE(double, name, val,                               \
+                              gflags::FlagConstraint::DoubleRange(lo, hi),     \
+                              help)
+
+// Building with GFLAGS_LAZY_STRING_DEFAULTS keeps the default of each
+// DEFINE_string as the bare literal instead of a second clstring, which
+// saves a construction (and often an allocation) per flag before main;
+// the clstring is built if the default is ever needed as one, eg for
+// SET_FLAGS_DEFAULT or a validator.  val must then be a const char*
+// constant.  FLAGS_name itself stays an ordinary clstring.
+#if defined(GFLAGS_LAZY_STRING_DEFAULTS)
+#define GFLAGS_STRING_DEFAULT(name, val)                                       \
+  static gflags::LazyString FLAGS_no##name = {val, false, {}}
+#else
+#define GFLAGS_STRING_DEFAULT(name, val)                                       \
+  static clstring FLAGS_no##name = clstring(val)
+#endif
+
 // We need to define a var named FLAGS_no##name so people don't define
 // --string and --nostring.  And we need a temporary place to put val
 // so we don't have to evaluate it twice.  Two great needs that go
@@ -463,12 +1545,337 @@ private:
   using gflags::Gflags;                                                        \
   using gflags::clstring;                                                      \
   clstring FLAGS_##name = clstring(val);                                       \
-  static clstring FLAGS_no##name = clstring(val);                              \
+  GFLAGS_STRING_DEFAULT(name, val);                                            \
+  GFLAGS_DEFINE_HELP(name, help);                                              \
+  static const bool name##_flag_registered = Gflags::RegisterCommandLineFlag(  \
+      #name, GFLAGS_HELP(name, help), __FILE__, &FLAGS_##name,                 \
+      &FLAGS_no##name);                                                        \
+  }                                                                            \
+  using gflags::FLAGS_##name
+
+// A string flag whose value must be one of the '|'-separated choices,
+// eg DEFINE_string_oneof(mode, "fast", "fast|safe|debug", "...").
+#define DEFINE_string_oneof(name, val, choices, help)                          \
+  namespace gflags {                                                           \
+  using gflags::Gflags;                                                        \
+  using gflags::clstring;                                                      \
+  clstring FLAGS_##name = clstring(val);                                       \
+  GFLAGS_STRING_DEFAULT(name, val);                                            \
+  static const gflags::FlagConstraint name##_flag_constraint =                 \
+      gflags::FlagConstraint::OneOf(choices);                                  \
+  GFLAGS_DEFINE_HELP(name, help);                                              \
+  static const bool name##_flag_registered = Gflags::RegisterCommandLineFlag(  \
+      #name, GFLAGS_HELP(name, help), __FILE__, &FLAGS_##name,                 \
+      &FLAGS_no##name, &name##_flag_constraint);                               \
+  }                                                                            \
+  using gflags::FLAGS_##name
+
+// The default of a flag whose default is written the way it would be on
+// the commandline, such as "80,443" or "250ms", parsed during static
+// initialization.  A default that does not parse is a bug in the
+// program, so it dies.
+template <typename FlagType>
+FlagType ParseFlagDefault(const char *name, const char *spec) {
+  FlagType parsed;
+  FlagValue value(&parsed, false);
+  if (!value.ParseFrom(spec))
+    ReportError(DIE, "ERROR: illegal default value '%s' for flag --%s\n",
+                spec, name);
+  return parsed;
+}
+
+#define DEFINE_PARSED_VARIABLE(type, name, spec, help)                         \
+  namespace gflags {                                                           \
+  using gflags::Gflags;                                                        \
+  type FLAGS_##name = gflags::ParseFlagDefault<type>(#name, spec);             \
+  static type FLAGS_no##name = FLAGS_##name;                                   \
+  GFLAGS_DEFINE_HELP(name, help);                                              \
   static const bool name##_flag_registered = Gflags::RegisterCommandLineFlag(  \
-      #name, help, __FILE__, &FLAGS_##name, &FLAGS_no##name);                  \
+      #name, GFLAGS_HELP(name, help), __FILE__, &FLAGS_##name,                 \
+      &FLAGS_no##name);                                                        \
+  }                                                                            \
+  using gflags::FLAGS_##name
+
+// Comma-separated list flags, eg
+//   DEFINE_int32_list(ports, "80,443", "Ports to listen on");
+//   for (size_t i = 0; i < FLAGS_ports.size(); ++i) Listen(FLAGS_ports[i]);
+// The empty string is the empty list.  Numeric elements follow the rules
+// of the scalar flag of the same type; string elements cannot contain
+// commas.
+#define DEFINE_int32_list(name, spec, help)                                    \
+  DEFINE_PARSED_VARIABLE(gflags::Int32List, name, spec, help)
+
+#define DEFINE_int64_list(name, spec, help)                                    \
+  DEFINE_PARSED_VARIABLE(gflags::Int64List, name, spec, help)
+
+#define DEFINE_double_list(name, spec, help)                                   \
+  DEFINE_PARSED_VARIABLE(gflags::DoubleList, name, spec, help)
+
+#define DEFINE_string_list(name, spec, help)                                   \
+  DEFINE_PARSED_VARIABLE(gflags::StringList, name, spec, help)
+
+// A duration with units, eg
+//   DEFINE_duration(rpc_timeout, "250ms", "Deadline for one RPC");
+//   deadline = now + FLAGS_rpc_timeout.nanoseconds();
+#define DEFINE_duration(name, spec, help)                                      \
+  DEFINE_PARSED_VARIABLE(gflags::Duration, name, spec, help)
+
+// A size in bytes with units, eg
+//   DEFINE_bytes(buffer_size, "64MiB", "Size of each IO buffer");
+//   buffer.resize(FLAGS_buffer_size.bytes());
+#define DEFINE_bytes(name, spec, help)                                         \
+  DEFINE_PARSED_VARIABLE(gflags::ByteSize, name, spec, help)
+
+// The default of a DEFINE_custom flag.  Dies if it does not parse, like
+// ParseFlagDefault().
+template <typename FlagType>
+FlagType ParseCustomFlagDefault(const char *name, const char *spec) {
+  FlagType parsed;
+  if (!FlagTypeTraits<FlagType>::Parse(spec, &parsed))
+    ReportError(DIE, "ERROR: illegal default value '%s' for flag --%s\n",
+                spec, name);
+  return parsed;
+}
+
+// A flag of a type described by a FlagTypeTraits specialization; see
+// "自定义类型" above.  spec is the default, spelled as on the
+// commandline.
+#define DEFINE_custom(type, name, spec, help)                                  \
+  namespace gflags {                                                           \
+  using gflags::Gflags;                                                        \
+  type FLAGS_##name = gflags::ParseCustomFlagDefault<type>(#name, spec);       \
+  static type FLAGS_no##name = FLAGS_##name;                                   \
+  GFLAGS_DEFINE_HELP(name, help);                                              \
+  static const bool name##_flag_registered =                                   \
+      Gflags::RegisterCustomCommandLineFlag(#name, GFLAGS_HELP(name, help),    \
+                                            __FILE__, &FLAGS_##name,           \
+                                            &FLAGS_no##name);                  \
+  }                                                                            \
+  using gflags::FLAGS_##name
+
+// ------------------------------------------------------------------------
+// 枚举类型
+//    An enum flag reads as the enum itself, so checking it is an integer
+//    compare rather than a strcmp:
+//
+//      enum class Mode { kFast, kSafe, kDebug };
+//      GFLAGS_ENUM_NAMES(Mode, {{"fast", Mode::kFast},
+//                               {"safe", Mode::kSafe},
+//                               {"debug", Mode::kDebug}});
+//      DEFINE_enum(mode, Mode, Mode::kFast, "How hard to try");
+//      if (FLAGS_mode == Mode::kDebug) ...
+//
+//    Only the names in the table parse, so the flag needs no validator.
+//    GFLAGS_ENUM_NAMES goes at global scope, in a header if the enum
+//    has flags in several files.
+// ------------------------------------------------------------------------
+
+template <typename EnumType> struct FlagEnumEntry {
+  const char *name;
+  EnumType value;
+};
+
+// Specialized by GFLAGS_ENUM_NAMES.
+template <typename EnumType> struct FlagEnumNames;
+
+// A perfect hash from an enum's names to their positions in its table,
+// built the first time a name is parsed.  Finding one costs a strcmp
+// against the one name that could match.
+class FlagEnumIndex {
+public:
+  // names must be distinct and outlive the index.
+  explicit FlagEnumIndex(const vector<const char *> &names);
+
+  // The position of name in the table, or -1 if it is not there.
+  int32 Find(const char *name) const;
+
+private:
+  static uint32 Hash(const char *name, uint32 seed);
+  uint32 Slot(const char *name) const {
+    return Hash(name, seed_) >> shift_;
+  }
+
+  vector<const char *> names_;
+  vector<int32> slots_; // position in names_, or -1
+  uint32 seed_;
+  uint32 shift_; // 32 - log2(slots_.size())
+};
+
+// The FlagTypeTraits for an enum with a GFLAGS_ENUM_NAMES table.
+template <typename EnumType> struct FlagEnumTraits {
+  typedef FlagEnumNames<EnumType> Names;
+
+  static const FlagEnumIndex &Index() {
+    static const FlagEnumIndex index(TableNames());
+    return index;
+  }
+
+  static bool Parse(const char *text, EnumType *value) {
+    size_t n;
+    const FlagEnumEntry<EnumType> *entries = Names::Entries(&n);
+    const int32 i = Index().Find(text);
+    if (i < 0)
+      return false;
+    *value = entries[i].value;
+    return true;
+  }
+
+  // NULL if value is not in the table.
+  static const char *NameOf(EnumType value) {
+    size_t n;
+    const FlagEnumEntry<EnumType> *entries = Names::Entries(&n);
+    // Tables usually list an enum in order from 0, and then the value is
+    // its own position.
+    const size_t i = static_cast<size_t>(value);
+    if (i < n && entries[i].value == value)
+      return entries[i].name;
+    for (size_t j = 0; j < n; ++j) {
+      if (entries[j].value == value)
+        return entries[j].name;
+    }
+    return NULL;
+  }
+
+  static string Format(const EnumType &value) {
+    const char *name = NameOf(value);
+    return name ? name : StringPrintf("%lld", static_cast<long long>(value));
+  }
+
+private:
+  static vector<const char *> TableNames() {
+    size_t n;
+    const FlagEnumEntry<EnumType> *entries = Names::Entries(&n);
+    vector<const char *> names(n);
+    for (size_t i = 0; i < n; ++i)
+      names[i] = entries[i].name;
+    return names;
+  }
+};
+
+// The default of a DEFINE_enum flag, which must be in the table.
+template <typename EnumType>
+EnumType CheckEnumFlagDefault(const char *name, EnumType value) {
+  if (FlagEnumTraits<EnumType>::NameOf(value) == NULL)
+    ReportError(DIE, "ERROR: default value of enum flag --%s is not in "
+                     "its GFLAGS_ENUM_NAMES table\n",
+                name);
+  return value;
+}
+
+#define GFLAGS_ENUM_NAMES(EnumType, ...)                                       \
+  namespace gflags {                                                           \
+  template <> struct FlagEnumNames<EnumType> {                                 \
+    static const FlagEnumEntry<EnumType> *Entries(size_t *n) {                 \
+      static constexpr FlagEnumEntry<EnumType> kEntries[] = __VA_ARGS__;       \
+      *n = sizeof(kEntries) / sizeof(kEntries[0]);                             \
+      return kEntries;                                                         \
+    }                                                                          \
+  };                                                                           \
+  template <>                                                                  \
+  struct FlagTypeTraits<EnumType> : public FlagEnumTraits<EnumType> {          \
+    static const char *Name() { return #EnumType; }                            \
+  };                                                                           \
+  } // namespace gflags
+
+#define DEFINE_enum(name, type, value, help)                                   \
+  namespace gflags {                                                           \
+  using gflags::Gflags;                                                        \
+  type FLAGS_##name = gflags::CheckEnumFlagDefault<type>(#name, value);        \
+  static type FLAGS_no##name = FLAGS_##name;                                   \
+  GFLAGS_DEFINE_HELP(name, help);                                              \
+  static const bool name##_flag_registered =                                   \
+      Gflags::RegisterCustomCommandLineFlag(#name, GFLAGS_HELP(name, help),    \
+                                            __FILE__, &FLAGS_##name,           \
+                                            &FLAGS_no##name);                  \
   }                                                                            \
   using gflags::FLAGS_##name
 
+// ------------------------------------------------------------------------
+// 映射文件
+//    A string flag for large payloads.  "--routes=@/etc/routes.json"
+//    maps the file read-only instead of copying it into a string, and
+//    setting the flag again swaps in a new mapping without copying
+//    either.  A value not starting with '@' is kept as it is; "@@x"
+//    stands for the literal "@x".
+//
+//      DEFINE_mapped_string(routes, "", "Routing table, or @file");
+//      MappedString::View routes = FLAGS_routes.Get();
+//      Parse(routes->data(), routes->size());
+//
+//    A View keeps its buffer alive, so a reader can go on using it after
+//    the flag has moved on; the old file is unmapped once the last View
+//    of it goes away.  Update a file by writing a new one and renaming
+//    it over the old, then setting the flag again: a mapping sees
+//    writes made to the file it maps.
+// ------------------------------------------------------------------------
+
+class MappedString;
+template <> struct FlagTypeTraits<MappedString>;
+
+class MappedBuffer {
+public:
+  ~MappedBuffer();
+
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  // The file this maps, or "" for a literal value.
+  const string &path() const { return path_; }
+
+private:
+  friend class MappedString;
+  friend struct FlagTypeTraits<MappedString>;
+  MappedBuffer()
+      : data_(""), size_(0), mapped_(false), dev_(0), ino_(0), mtime_ns_(0) {}
+
+  const char *data_;
+  size_t size_;
+  bool mapped_;    // data_ is a mapping of size_ bytes
+  string literal_; // data_ points here when !mapped_
+  string path_;
+  // Which version of which file path_ named when it was mapped.
+  uint64 dev_;
+  uint64 ino_;
+  int64 mtime_ns_;
+
+  MappedBuffer(const MappedBuffer &);
+  void operator=(const MappedBuffer &);
+};
+
+class MappedString {
+public:
+  typedef std::shared_ptr<const MappedBuffer> View;
+
+  MappedString();
+  MappedString(const MappedString &x) : buffer_(x.Get()) {}
+  MappedString &operator=(const MappedString &x) {
+    std::atomic_store(&buffer_, x.Get());
+    return *this;
+  }
+
+  // The current value.  Safe to call while the flag is being set.
+  View Get() const { return std::atomic_load(&buffer_); }
+
+  // The same literal, or the same file as of the same modification:
+  // a file is compared by path, inode, mtime and size, never by reading
+  // it, so that setting a large file again costs no more than a small
+  // one.
+  bool operator==(const MappedString &x) const;
+
+private:
+  friend struct FlagTypeTraits<MappedString>;
+  View buffer_;
+};
+
+template <> struct FlagTypeTraits<MappedString> {
+  static const char *Name() { return "mapped_string"; }
+  static bool Parse(const char *text, MappedString *value);
+  // "@path" for a mapped file, so that --help never prints the payload.
+  static string Format(const MappedString &value);
+};
+
+#define DEFINE_mapped_string(name, spec, help)                                 \
+  DEFINE_custom(gflags::MappedString, name, spec, help)
+
 // Convenience macro for the registration of a flag validator
 #define DEFINE_validator(name, validator)                                      \
   namespace gflags {                                                           \
@@ -477,6 +1884,21 @@ private:
       Gflags::RegisterFlagValidator(&FLAGS_##name, validator);                 \
   } // namespace gflags
 
+// Convenience macro for the registration of a validator over several
+// flags.  The validator takes no arguments and reads the flags itself:
+//   static bool ConnsInOrder() { return FLAGS_min_conns <= FLAGS_max_conns; }
+//   DEFINE_cross_validator(conns_in_order, ConnsInOrder,
+//                          &FLAGS_min_conns, &FLAGS_max_conns);
+#define DEFINE_cross_validator(name, validator, ...)                           \
+  namespace gflags {                                                           \
+  using gflags::Gflags;                                                        \
+  static const void *const name##_cross_flags[] = {__VA_ARGS__};               \
+  static const bool name##_cross_validator_registered =                        \
+      Gflags::RegisterCrossFlagValidator(                                      \
+          #name, validator, name##_cross_flags,                                \
+          sizeof(name##_cross_flags) / sizeof(*name##_cross_flags));           \
+  } // namespace gflags
+
 } // namespace gflags
 
 #endif
\ No newline at end of file
@@ -0,0 +1,597 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "gflags.h"
+
+using gflags::AdminServer;
+using gflags::CommandLineFlag;
+using gflags::FlagRegistry;
+using gflags::FlagRegistryLock;
+using gflags::FlagRegistryReaderLock;
+using gflags::FlagShardLock;
+using gflags::FlagValue;
+using gflags::kError;
+using gflags::SET_FLAGS_VALUE;
+using gflags::StringPrintf;
+using gflags::uint64;
+using std::map;
+using std::pair;
+using std::string;
+using std::vector;
+
+namespace {
+
+// A client that sends a longer line, or lets this much of its replies
+// pile up unread, is disconnected.
+const size_t kMaxLine = 64 * 1024;
+const size_t kMaxPendingOutput = 1024 * 1024;
+// How often the thread looks for changed flags while anyone watches.
+const int kWatchPollMillis = 50;
+
+} // namespace
+
+struct AdminServer::Connection {
+  int fd;
+  uint32_t events;  // registered with epoll
+  bool read_closed; // the client shut down its side; close once flushed
+  string in;       // received, up to an incomplete line
+  string out;      // not yet sent
+  // The watched flags and the values last sent for them.
+  vector<const CommandLineFlag *> watched;
+  vector<string> watched_values;
+};
+
+namespace {
+
+typedef AdminServer::Connection Connection;
+
+void SplitWords(const string &line, vector<string> *words) {
+  size_t i = 0;
+  while (i < line.size()) {
+    const size_t begin = line.find_first_not_of(" \t", i);
+    if (begin == string::npos)
+      break;
+    size_t end = line.find_first_of(" \t", begin);
+    if (end == string::npos)
+      end = line.size();
+    words->push_back(line.substr(begin, end - begin));
+    i = end;
+  }
+}
+
+void AppendValue(string *out, const CommandLineFlag *flag,
+                 const string &value) {
+  out->append(flag->name());
+  out->push_back('=');
+  out->append(value);
+  out->push_back('\n');
+}
+
+// Error messages from the registry start with "ERROR: " and end in a
+// newline; the reply has its own of both.
+string TrimMessage(const string &msg) {
+  size_t begin = 0, end = msg.size();
+  if (msg.compare(0, strlen(kError), kError) == 0)
+    begin = strlen(kError);
+  while (end > begin && msg[end - 1] == '\n')
+    --end;
+  return msg.substr(begin, end - begin);
+}
+
+// --------------------------------------------------------------------
+// Commands
+//    Each one builds its whole reply under the lock and sends it after,
+//    so the lock is never held across a system call.
+// --------------------------------------------------------------------
+
+void CommandGet(const vector<string> &words, string *reply) {
+  if (words.size() < 2) {
+    *reply = "ERR usage: get NAME...\n";
+    return;
+  }
+  FlagRegistry *const registry = FlagRegistry::GlobalRegistry();
+  FlagRegistryReaderLock frl(registry);
+  for (size_t i = 1; i < words.size(); ++i) {
+    const CommandLineFlag *flag = registry->FindFlagLocked(words[i].c_str());
+    if (flag == NULL) {
+      *reply = "ERR unknown flag '" + words[i] + "'\n";
+      return;
+    }
+    FlagShardLock fsl(registry, FlagRegistry::ShardBit(flag), false);
+    AppendValue(reply, flag, flag->current_value());
+  }
+  reply->append("OK\n");
+}
+
+// Appends the flags matching pattern, and their values, to flags and
+// values.
+void GetMatching(const char *pattern, vector<const CommandLineFlag *> *flags,
+                 vector<string> *values) {
+  FlagRegistry *const registry = FlagRegistry::GlobalRegistry();
+  FlagRegistryReaderLock frl(registry);
+  registry->GetFlagsMatchingLocked(pattern, flags);
+  values->resize(flags->size());
+  for (size_t i = 0; i < flags->size(); ++i) {
+    FlagShardLock fsl(registry, FlagRegistry::ShardBit((*flags)[i]), false);
+    (*values)[i] = (*flags)[i]->current_value();
+  }
+}
+
+void CommandList(const vector<string> &words, string *reply) {
+  if (words.size() > 2) {
+    *reply = "ERR usage: list [PATTERN]\n";
+    return;
+  }
+  vector<const CommandLineFlag *> flags;
+  vector<string> values;
+  GetMatching(words.size() == 2 ? words[1].c_str() : "*", &flags, &values);
+  for (size_t i = 0; i < flags.size(); ++i)
+    AppendValue(reply, flags[i], values[i]);
+  reply->append("OK\n");
+}
+
+} // namespace
+
+void AdminServer::CommandSet(const vector<string> &words, string *reply) {
+  if (words.size() < 2) {
+    *reply = "ERR usage: set NAME=VALUE...\n";
+    return;
+  }
+  // Split and look everything up before changing anything, so that a
+  // mistyped name does not leave half a batch applied.
+  vector<pair<string, string> > assignments;
+  for (size_t i = 1; i < words.size(); ++i) {
+    const size_t eq = words[i].find('=');
+    if (eq == string::npos || eq == 0) {
+      *reply = "ERR expected NAME=VALUE, got '" + words[i] + "'\n";
+      return;
+    }
+    assignments.push_back(
+        pair<string, string>(words[i].substr(0, eq), words[i].substr(eq + 1)));
+  }
+
+  vector<string> errors;
+  vector<pair<string, string> > constraint_errors;
+  {
+    FlagRegistry *const registry = FlagRegistry::GlobalRegistry();
+    FlagRegistryLock frl(registry);
+    vector<CommandLineFlag *> flags(assignments.size());
+    for (size_t i = 0; i < assignments.size(); ++i) {
+      flags[i] = registry->FindFlagLocked(assignments[i].first.c_str());
+      if (flags[i] == NULL) {
+        *reply = "ERR unknown flag '" + assignments[i].first + "'\n";
+        return;
+      }
+    }
+    // Copies of the values themselves, not their text, so that undoing
+    // restores exactly what was there: the modified bit, and for a
+    // mapped string the old mapping rather than whatever the file
+    // holds now.
+    vector<FlagValue *> saved(flags.size());
+    vector<bool> saved_modified(flags.size());
+    for (size_t i = 0; i < flags.size(); ++i) {
+      saved[i] = flags[i]->current_->New();
+      saved[i]->CopyFrom(*flags[i]->current_);
+      saved_modified[i] = flags[i]->Modified();
+    }
+    registry->BeginBatchLocked();
+    for (size_t i = 0; i < assignments.size(); ++i) {
+      string msg;
+      if (!registry->SetFlagLocked(flags[i], assignments[i].second.c_str(),
+                                   SET_FLAGS_VALUE, &msg))
+        errors.push_back(TrimMessage(msg));
+    }
+    registry->EndBatchLocked(&constraint_errors);
+    for (size_t i = 0; i < constraint_errors.size(); ++i)
+      errors.push_back(TrimMessage(constraint_errors[i].second));
+
+    // Unlike the commandline, a live process must not be left with half
+    // a change, or with flags that violate a constraint.  Code going
+    // through the registry never sees the new values, since the lock is
+    // still held; code reading FLAGS_* directly may, briefly.
+    for (size_t i = 0; i < flags.size(); ++i) {
+      if (!errors.empty()) {
+        flags[i]->current_->CopyFrom(*saved[i]);
+        flags[i]->set_modified(saved_modified[i]);
+      }
+      delete saved[i];
+    }
+  }
+
+  if (errors.empty()) {
+    *reply = "OK\n";
+    return;
+  }
+  *reply = "ERR ";
+  for (size_t i = 0; i < errors.size(); ++i) {
+    if (i > 0)
+      reply->append("; ");
+    reply->append(errors[i]);
+  }
+  reply->push_back('\n');
+}
+
+AdminServer::AdminServer()
+    : listen_fd_(-1), epoll_fd_(-1), wake_fd_(-1), running_(false),
+      accept_paused_(false), watchers_(0), watch_generation_(0) {}
+
+AdminServer::~AdminServer() { Stop(); }
+
+// --------------------------------------------------------------------
+// Start()
+//    Only a stale socket is replaced: one that exists, is a socket, and
+//    refuses connections.  A second server on the same path fails to
+//    start instead of taking over from the first, and a path naming
+//    anything else is an error rather than something to delete.
+// --------------------------------------------------------------------
+
+bool AdminServer::Start(const char *path, string *error) {
+  if (running_) {
+    *error = "already started";
+    return false;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    *error = StringPrintf("socket path too long: %s", path);
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      *error = StringPrintf("%s exists and is not a socket", path);
+      return false;
+    }
+    const int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (probe < 0) {
+      *error = StringPrintf("%s: %s", path, strerror(errno));
+      return false;
+    }
+    const int r = connect(probe, (struct sockaddr *)&addr, sizeof(addr));
+    const int connect_errno = errno;
+    close(probe);
+    if (r == 0 || connect_errno == EAGAIN) {
+      *error = StringPrintf("%s is in use", path);
+      return false;
+    }
+    if (connect_errno != ECONNREFUSED) {
+      *error = StringPrintf("%s: %s", path, strerror(connect_errno));
+      return false;
+    }
+    if (unlink(path) != 0) {
+      *error = StringPrintf("%s: %s", path, strerror(errno));
+      return false;
+    }
+  } else if (errno != ENOENT) {
+    *error = StringPrintf("%s: %s", path, strerror(errno));
+    return false;
+  }
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0 ||
+      bind(listen_fd_, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    *error = StringPrintf("%s: %s", path, strerror(errno));
+    Stop();
+    return false;
+  }
+  path_ = path;
+  // Nothing can connect before listen(), so chmod() after bind() leaves
+  // no window.
+  if (chmod(path, 0600) != 0 || listen(listen_fd_, 16) != 0) {
+    *error = StringPrintf("%s: %s", path, strerror(errno));
+    Stop();
+    return false;
+  }
+
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  bool ok = epoll_fd_ >= 0 && wake_fd_ >= 0;
+  ev.data.fd = listen_fd_;
+  ok = ok && epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev) == 0;
+  ev.data.fd = wake_fd_;
+  ok = ok && epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev) == 0;
+  watch_generation_ = FlagRegistry::GlobalRegistry()->generation();
+  if (ok) {
+    // The thread starts with every signal blocked, so that signals meant
+    // for the application are never delivered to it.
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    const int r = pthread_create(&thread_, NULL, ThreadMain, this);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (r != 0)
+      errno = r;
+    ok = r == 0;
+  }
+  if (!ok) {
+    *error = StringPrintf("starting the admin server: %s", strerror(errno));
+    Stop();
+    return false;
+  }
+  running_ = true;
+  return true;
+}
+
+// Also cleans up after a Start() that failed halfway.
+void AdminServer::Stop() {
+  if (running_) {
+    const uint64 one = 1;
+    while (write(wake_fd_, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+    pthread_join(thread_, NULL);
+    running_ = false;
+  }
+  while (!connections_.empty())
+    Close(connections_.begin()->second);
+  const int fds[] = {listen_fd_, epoll_fd_, wake_fd_};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+    if (fds[i] >= 0)
+      close(fds[i]);
+  }
+  listen_fd_ = epoll_fd_ = wake_fd_ = -1;
+  if (!path_.empty()) {
+    unlink(path_.c_str());
+    path_.clear();
+  }
+}
+
+void *AdminServer::ThreadMain(void *arg) {
+  static_cast<AdminServer *>(arg)->Run();
+  return NULL;
+}
+
+// --------------------------------------------------------------------
+// Run()
+//    Level-triggered epoll over the listening socket, the eventfd and
+//    every client.  While anyone watches, epoll_wait() times out every
+//    kWatchPollMillis so that sets made by other threads are seen too;
+//    while accepting is paused, so that it is retried as often.
+// --------------------------------------------------------------------
+
+void AdminServer::Run() {
+  struct epoll_event events[64];
+  for (;;) {
+    const int timeout =
+        watchers_ > 0 || accept_paused_ ? kWatchPollMillis : -1;
+    const int n = epoll_wait(epoll_fd_, events, 64, timeout);
+    if (n < 0 && errno != EINTR)
+      return;
+    if (accept_paused_)
+      ResumeAccept();
+    for (int i = 0; i < n; ++i) {
+      const int fd = events[i].data.fd;
+      if (fd == wake_fd_)
+        return;
+      if (fd == listen_fd_) {
+        Accept();
+        continue;
+      }
+      map<int, Connection *>::iterator it = connections_.find(fd);
+      if (it == connections_.end())
+        continue;
+      Connection *conn = it->second;
+      if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !Read(conn))
+        continue;
+      if (events[i].events & EPOLLOUT)
+        Write(conn);
+    }
+    PollWatches();
+  }
+}
+
+void AdminServer::ResumeAccept() {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev) == 0)
+    accept_paused_ = false;
+}
+
+void AdminServer::Accept() {
+  for (;;) {
+    const int fd =
+        accept4(listen_fd_, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      // Out of descriptors, the pending connection stays pending and
+      // the level-triggered listening socket readable, so stop watching
+      // it for a while rather than spin.
+      if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS ||
+          errno == ENOMEM) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, listen_fd_, NULL);
+        accept_paused_ = true;
+      }
+      return;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+      close(fd);
+      continue;
+    }
+    Connection *conn = new Connection;
+    conn->fd = fd;
+    conn->events = EPOLLIN;
+    conn->read_closed = false;
+    connections_[fd] = conn;
+  }
+}
+
+// A client may send its commands and shut down its side of the socket
+// right away, as "echo get x | socat ..." does, so the lines that came
+// before the end of input still run, and their replies still go out,
+// before the connection is closed.
+bool AdminServer::Read(Connection *conn) {
+  char buf[4096];
+  while (!conn->read_closed) {
+    const ssize_t r = read(conn->fd, buf, sizeof(buf));
+    if (r > 0) {
+      conn->in.append(buf, r);
+      continue;
+    }
+    if (r == 0) {
+      conn->read_closed = true;
+      if (!conn->in.empty() && conn->in[conn->in.size() - 1] != '\n')
+        conn->in.push_back('\n'); // the last line needs no newline
+      break;
+    }
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0 && errno == EAGAIN)
+      break;
+    Close(conn); // broken
+    return false;
+  }
+
+  size_t begin = 0;
+  for (;;) {
+    const size_t end = conn->in.find('\n', begin);
+    if (end == string::npos)
+      break;
+    size_t line_end = end;
+    if (line_end > begin && conn->in[line_end - 1] == '\r')
+      --line_end;
+    Execute(conn, conn->in.substr(begin, line_end - begin));
+    begin = end + 1;
+  }
+  conn->in.erase(0, begin);
+  if (conn->in.size() > kMaxLine) {
+    Close(conn);
+    return false;
+  }
+  return Write(conn);
+}
+
+bool AdminServer::Write(Connection *conn) {
+  size_t sent = 0;
+  while (sent < conn->out.size()) {
+    const ssize_t r = send(conn->fd, conn->out.data() + sent,
+                           conn->out.size() - sent, MSG_NOSIGNAL);
+    if (r > 0) {
+      sent += r;
+      continue;
+    }
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0 && errno == EAGAIN)
+      break;
+    Close(conn);
+    return false;
+  }
+  conn->out.erase(0, sent);
+  if (conn->out.size() > kMaxPendingOutput) {
+    Close(conn); // not reading its replies, or its watch
+    return false;
+  }
+
+  if (conn->read_closed && conn->out.empty()) {
+    Close(conn);
+    return false;
+  }
+
+  // A socket at end of input stays readable, so it is only watched for
+  // room to write.
+  const uint32_t events =
+      (conn->read_closed ? 0u : static_cast<uint32_t>(EPOLLIN)) |
+      (conn->out.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+  if (events != conn->events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = conn->fd;
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, conn->fd, &ev);
+    conn->events = events;
+  }
+  return true;
+}
+
+void AdminServer::Close(Connection *conn) {
+  if (!conn->watched.empty())
+    --watchers_;
+  close(conn->fd); // which also takes it out of the epoll set
+  connections_.erase(conn->fd);
+  delete conn;
+}
+
+void AdminServer::Execute(Connection *conn, const string &line) {
+  vector<string> words;
+  SplitWords(line, &words);
+  if (words.empty())
+    return;
+  const string &command = words[0];
+  string reply;
+  if (command == "get") {
+    CommandGet(words, &reply);
+  } else if (command == "set") {
+    CommandSet(words, &reply);
+  } else if (command == "list") {
+    CommandList(words, &reply);
+  } else if (command == "watch") {
+    if (words.size() != 2) {
+      reply = "ERR usage: watch PATTERN\n";
+    } else {
+      if (!conn->watched.empty())
+        --watchers_;
+      conn->watched.clear();
+      GetMatching(words[1].c_str(), &conn->watched, &conn->watched_values);
+      if (!conn->watched.empty())
+        ++watchers_;
+      for (size_t i = 0; i < conn->watched.size(); ++i)
+        AppendValue(&reply, conn->watched[i], conn->watched_values[i]);
+      reply.append("OK\n");
+    }
+  } else {
+    reply = "ERR unknown command '" + command + "'\n";
+  }
+  conn->out.append(reply);
+}
+
+void AdminServer::PollWatches() {
+  if (watchers_ == 0)
+    return;
+  FlagRegistry *const registry = FlagRegistry::GlobalRegistry();
+  const uint64 generation = registry->generation();
+  if (generation == watch_generation_)
+    return;
+  watch_generation_ = generation;
+
+  vector<Connection *> changed;
+  {
+    FlagRegistryReaderLock frl(registry);
+    string value;
+    for (map<int, Connection *>::iterator it = connections_.begin();
+         it != connections_.end(); ++it) {
+      Connection *conn = it->second;
+      const size_t before = conn->out.size();
+      for (size_t i = 0; i < conn->watched.size(); ++i) {
+        const CommandLineFlag *flag = conn->watched[i];
+        {
+          FlagShardLock fsl(registry, FlagRegistry::ShardBit(flag), false);
+          value = flag->current_value();
+        }
+        if (value != conn->watched_values[i]) {
+          conn->watched_values[i] = value;
+          AppendValue(&conn->out, flag, value);
+        }
+      }
+      if (conn->out.size() != before)
+        changed.push_back(conn);
+    }
+  }
+  for (size_t i = 0; i < changed.size(); ++i)
+    Write(changed[i]);
+}
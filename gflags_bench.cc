@@ -0,0 +1,492 @@
+// Microbenchmarks for the flag registry, on Google Benchmark.
+//
+// Every benchmark works on a private FlagRegistry filled with synthetic
+// flags, so the numbers do not depend on what the binary happens to
+// define.  For results a script can compare between builds:
+//
+//   ./gflags_bench --benchmark_format=json --benchmark_out=bench.json
+//   ./gflags_bench --benchmark_filter=FindFlag
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "gflags.h"
+
+using gflags::ByteSize;
+using gflags::clstring;
+using gflags::CommandLineFlag;
+using gflags::CommandLineFlagParser;
+using gflags::DoubleList;
+using gflags::Duration;
+using gflags::FlagConstraint;
+using gflags::FlagRegistry;
+using gflags::FlagRegistryLock;
+using gflags::FlagRegistryReaderLock;
+using gflags::FlagShardLock;
+using gflags::FlagTypeOpsFor;
+using gflags::FlagValue;
+using gflags::Gflags;
+using gflags::Int32List;
+using gflags::Int64List;
+using gflags::MappedString;
+using gflags::StringList;
+using gflags::int32;
+using gflags::int64;
+using gflags::uint32;
+using gflags::uint64;
+using gflags::SET_FLAGS_VALUE;
+using std::string;
+using std::vector;
+
+static const char kFile[] = "gflags_bench.cc";
+static const char kHelp[] = "Synthetic flag for gflags_bench";
+
+// One flag in eight carries a range, so validation walks have something
+// to check.
+static const FlagConstraint kRange = FlagConstraint::IntRange(0, 1000000);
+static const int kConstrainedEvery = 8;
+
+template <typename T> static CommandLineFlag *NewFlag(const char *name, T v) {
+  return new CommandLineFlag(name, kHelp, kFile,
+                             new FlagValue(new T(v), true),
+                             new FlagValue(new T(v), true));
+}
+
+// Flag names, which must outlive any registry holding them.
+static vector<string> MakeNames(const char *format, int n) {
+  vector<string> names;
+  names.reserve(n); // the registry keeps pointers into these
+  char buf[64];
+  for (int i = 0; i < n; ++i) {
+    snprintf(buf, sizeof(buf), format, i);
+    names.push_back(buf);
+  }
+  return names;
+}
+
+// A registry of n int32 flags named flag_<i>.
+class SyntheticRegistry {
+public:
+  explicit SyntheticRegistry(int n)
+      : names_(MakeNames("flag_%d", n)), registry_(new FlagRegistry) {
+    for (int i = 0; i < n; ++i) {
+      registry_->RegisterFlag(NewFlag<int32>(names_[i].c_str(), i),
+                             i % kConstrainedEvery == 0 ? &kRange : NULL);
+    }
+  }
+
+  FlagRegistry *registry() { return registry_.get(); }
+  const vector<string> &names() const { return names_; }
+
+private:
+  const vector<string> names_; // declared first, destroyed last
+  // Through FlagRegistry::operator new, which honours the alignment of
+  // its shards; a by-value member of a plain new'd object would not.
+  std::unique_ptr<FlagRegistry> registry_;
+};
+
+// ------------------------------------------------------------------------
+// Registration
+// ------------------------------------------------------------------------
+
+static void BM_RegisterFlags(benchmark::State &state) {
+  const int n = state.range(0);
+  const vector<string> names = MakeNames("flag_%d", n);
+  for (auto _ : state) {
+    FlagRegistry *registry = new FlagRegistry;
+    for (int i = 0; i < n; ++i) {
+      registry->RegisterFlag(NewFlag<int32>(names[i].c_str(), i),
+                             i % kConstrainedEvery == 0 ? &kRange : NULL);
+    }
+    state.PauseTiming();
+    delete registry;
+    state.ResumeTiming();
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_RegisterFlags)->RangeMultiplier(10)->Range(100, 100000);
+
+// ------------------------------------------------------------------------
+// Parsing
+// ------------------------------------------------------------------------
+
+// Parses argc - 1 "--flag_<i>=<i>" arguments against a 10000-flag registry.
+static void BM_ParseNewCommandLineFlags(benchmark::State &state) {
+  const int nflags = 10000;
+  const int nargs = state.range(0);
+  SyntheticRegistry flags(nflags);
+  vector<string> args(1, "gflags_bench");
+  for (int i = 0; i < nargs; ++i) {
+    const int flag = (i * 7919) % nflags; // scattered over the map
+    args.push_back("--" + flags.names()[flag] + "=" + std::to_string(i));
+  }
+  vector<char *> argv;
+  Gflags gflags;
+  for (auto _ : state) {
+    state.PauseTiming();
+    argv.clear();
+    for (size_t i = 0; i < args.size(); ++i)
+      argv.push_back(const_cast<char *>(args[i].c_str()));
+    int argc = argv.size();
+    char **argvp = argv.data();
+    state.ResumeTiming();
+
+    CommandLineFlagParser parser(&gflags, flags.registry());
+    benchmark::DoNotOptimize(
+        parser.ParseNewCommandLineFlags(&argc, &argvp, false));
+  }
+  state.SetItemsProcessed(state.iterations() * nargs);
+}
+BENCHMARK(BM_ParseNewCommandLineFlags)->RangeMultiplier(4)->Range(1, 1024);
+
+// ------------------------------------------------------------------------
+// Lookup
+// ------------------------------------------------------------------------
+
+static void BM_FindFlagHit(benchmark::State &state) {
+  SyntheticRegistry flags(state.range(0));
+  const vector<string> &names = flags.names();
+  FlagRegistryLock frl(flags.registry());
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        flags.registry()->FindFlagLocked(names[i].c_str()));
+    if (++i == names.size())
+      i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FindFlagHit)->RangeMultiplier(10)->Range(100, 100000);
+
+static void BM_FindFlagMiss(benchmark::State &state) {
+  SyntheticRegistry flags(state.range(0));
+  const vector<string> misses = MakeNames("no_such_flag_%d", 1024);
+  FlagRegistryLock frl(flags.registry());
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        flags.registry()->FindFlagLocked(misses[i].c_str()));
+    if (++i == misses.size())
+      i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FindFlagMiss)->RangeMultiplier(10)->Range(100, 100000);
+
+// An unknown flag one edit away from a real one, as a typo on the
+// commandline would be.  The first lookup builds the suggestion index
+// outside the timed loop.
+static void BM_SuggestUnknownFlag(benchmark::State &state) {
+  SyntheticRegistry flags(state.range(0));
+  const vector<string> typos = MakeNames("flag_%dx", 1024);
+  FlagRegistryLock frl(flags.registry());
+  string key, error;
+  const char *value;
+  flags.registry()->SplitArgumentLocked("no_such_flag", &key, &value, &error);
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(flags.registry()->SplitArgumentLocked(
+        typos[i].c_str(), &key, &value, &error));
+    if (++i == typos.size())
+      i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SuggestUnknownFlag)->RangeMultiplier(10)->Range(100, 100000);
+
+// "flag_123*" resolves through the prefix range; "*_123" has no prefix
+// and runs fnmatch() over every name.
+static void BM_GetFlagsMatching(benchmark::State &state, const char *pattern) {
+  SyntheticRegistry flags(state.range(0));
+  FlagRegistryReaderLock frl(flags.registry());
+  vector<const CommandLineFlag *> output;
+  for (auto _ : state) {
+    output.clear();
+    flags.registry()->GetFlagsMatchingLocked(pattern, &output);
+    benchmark::DoNotOptimize(output.data());
+  }
+  state.counters["matches"] = output.size();
+}
+BENCHMARK_CAPTURE(BM_GetFlagsMatching, prefix, "flag_123*")
+    ->RangeMultiplier(10)
+    ->Range(1000, 100000);
+BENCHMARK_CAPTURE(BM_GetFlagsMatching, glob, "*_123")
+    ->RangeMultiplier(10)
+    ->Range(1000, 100000);
+
+// ------------------------------------------------------------------------
+// Per-type set, parse and print
+// ------------------------------------------------------------------------
+
+// Two spellings of a value of each type; the loops alternate between
+// them so that every set is a real change.
+template <typename T> struct BenchValues;
+#define GFLAGS_BENCH_VALUES(type, v1, v2)                                      \
+  template <> struct BenchValues<type> {                                       \
+    static const char *first() { return v1; }                                  \
+    static const char *second() { return v2; }                                 \
+  }
+GFLAGS_BENCH_VALUES(bool, "true", "false");
+GFLAGS_BENCH_VALUES(int32, "-123456", "654321");
+GFLAGS_BENCH_VALUES(uint32, "123456", "0x7fff");
+GFLAGS_BENCH_VALUES(int64, "-1234567890123", "9876543210");
+GFLAGS_BENCH_VALUES(uint64, "1234567890123", "0xffffffffff");
+GFLAGS_BENCH_VALUES(double, "3.14159", "-2.5e10");
+GFLAGS_BENCH_VALUES(clstring, "/var/log/server", "/tmp/x");
+GFLAGS_BENCH_VALUES(Int32List, "80,443,8080,8443", "1,2,3,4,5,6,7,8");
+GFLAGS_BENCH_VALUES(Int64List, "-1234567890123,0", "9876543210,1,2");
+GFLAGS_BENCH_VALUES(DoubleList, "0.5,0.25,0.125", "3.14159,-2.5e10");
+GFLAGS_BENCH_VALUES(StringList, "us-east,us-west,eu-central", "a,b,c,d,e");
+GFLAGS_BENCH_VALUES(Duration, "250ms", "1h30m");
+GFLAGS_BENCH_VALUES(ByteSize, "64MiB", "1.5GB");
+#undef GFLAGS_BENCH_VALUES
+
+template <typename T> static void BM_SetFlagLocked(benchmark::State &state) {
+  FlagRegistry registry;
+  CommandLineFlag *flag = NewFlag<T>("flag", T());
+  registry.RegisterFlag(flag);
+  FlagRegistryLock frl(&registry);
+  string msg;
+  bool odd = false;
+  for (auto _ : state) {
+    odd = !odd;
+    const char *value =
+        odd ? BenchValues<T>::first() : BenchValues<T>::second();
+    benchmark::DoNotOptimize(
+        registry.SetFlagLocked(flag, value, SET_FLAGS_VALUE, &msg));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <typename T> static void BM_ParseFrom(benchmark::State &state) {
+  FlagValue value(new T(), true);
+  bool odd = false;
+  for (auto _ : state) {
+    odd = !odd;
+    benchmark::DoNotOptimize(value.ParseFrom(
+        odd ? BenchValues<T>::first() : BenchValues<T>::second()));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <typename T> static void BM_ToString(benchmark::State &state) {
+  FlagValue value(new T(), true);
+  value.ParseFrom(BenchValues<T>::first());
+  for (auto _ : state)
+    benchmark::DoNotOptimize(value.ToString());
+  state.SetItemsProcessed(state.iterations());
+}
+
+#define GFLAGS_BENCH_ALL_TYPES(bm)                                             \
+  BENCHMARK_TEMPLATE(bm, bool);                                                \
+  BENCHMARK_TEMPLATE(bm, int32);                                               \
+  BENCHMARK_TEMPLATE(bm, uint32);                                              \
+  BENCHMARK_TEMPLATE(bm, int64);                                               \
+  BENCHMARK_TEMPLATE(bm, uint64);                                              \
+  BENCHMARK_TEMPLATE(bm, double);                                              \
+  BENCHMARK_TEMPLATE(bm, clstring);                                            \
+  BENCHMARK_TEMPLATE(bm, Int32List);                                           \
+  BENCHMARK_TEMPLATE(bm, Int64List);                                           \
+  BENCHMARK_TEMPLATE(bm, DoubleList);                                          \
+  BENCHMARK_TEMPLATE(bm, StringList);                                          \
+  BENCHMARK_TEMPLATE(bm, Duration);                                            \
+  BENCHMARK_TEMPLATE(bm, ByteSize)
+
+GFLAGS_BENCH_ALL_TYPES(BM_SetFlagLocked);
+GFLAGS_BENCH_ALL_TYPES(BM_ParseFrom);
+GFLAGS_BENCH_ALL_TYPES(BM_ToString);
+
+// Enum names go through the perfect hash; the linear variant is the
+// strcmp chain that a string flag with the same choices needs.
+static const char *const kEnumNames[] = {
+    "none",   "fast",  "safe",   "debug", "trace",  "audit", "replay", "dry",
+    "strict", "loose", "legacy", "next",  "canary", "stage", "prod",   "test",
+};
+static const size_t kNumEnumNames = sizeof(kEnumNames) / sizeof(*kEnumNames);
+
+static void BM_EnumFind(benchmark::State &state) {
+  const gflags::FlagEnumIndex index(
+      vector<const char *>(kEnumNames, kEnumNames + kNumEnumNames));
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(index.Find(kEnumNames[i]));
+    if (++i == kNumEnumNames)
+      i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EnumFind);
+
+static void BM_EnumFindLinear(benchmark::State &state) {
+  size_t i = 0;
+  for (auto _ : state) {
+    size_t j = 0;
+    while (j < kNumEnumNames && strcmp(kEnumNames[j], kEnumNames[i]) != 0)
+      ++j;
+    benchmark::DoNotOptimize(j);
+    if (++i == kNumEnumNames)
+      i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_EnumFindLinear);
+
+// Setting a payload of state.range(0) bytes: a string flag parses it
+// into a tentative copy and copies that into the flag, a mapped string
+// maps the file and shares the mapping.  The two values alternate so
+// that every set is a real change.
+static void BM_SetLargeString(benchmark::State &state) {
+  const string values[2] = {string(state.range(0), 'a'),
+                            string(state.range(0), 'b')};
+  FlagRegistry registry;
+  CommandLineFlag *flag = NewFlag<clstring>("flag", "");
+  registry.RegisterFlag(flag);
+  FlagRegistryLock frl(&registry);
+  string msg;
+  size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(registry.SetFlagLocked(
+        flag, values[i ^= 1].c_str(), SET_FLAGS_VALUE, &msg));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SetLargeString)->RangeMultiplier(16)->Range(1 << 10, 1 << 22);
+
+static void BM_SetLargeMappedString(benchmark::State &state) {
+  string specs[2];
+  for (int i = 0; i < 2; ++i) {
+    char path[] = "/tmp/gflags_bench_XXXXXX";
+    const int fd = mkstemp(path);
+    const string payload(state.range(0), 'a' + i);
+    if (fd < 0 || write(fd, payload.data(), payload.size()) !=
+                      static_cast<ssize_t>(payload.size())) {
+      state.SkipWithError("cannot write a temporary file");
+      return;
+    }
+    close(fd);
+    specs[i] = string("@") + path;
+  }
+  const gflags::FlagTypeOps *ops = FlagTypeOpsFor<MappedString>();
+  FlagRegistry registry;
+  CommandLineFlag *flag = new CommandLineFlag(
+      "flag", kHelp, kFile, new FlagValue(new MappedString, ops, true),
+      new FlagValue(new MappedString, ops, true));
+  registry.RegisterFlag(flag);
+  {
+    FlagRegistryLock frl(&registry);
+    string msg;
+    size_t i = 0;
+    for (auto _ : state) {
+      benchmark::DoNotOptimize(registry.SetFlagLocked(
+          flag, specs[i ^= 1].c_str(), SET_FLAGS_VALUE, &msg));
+    }
+  }
+  for (int i = 0; i < 2; ++i)
+    unlink(specs[i].c_str() + 1);
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SetLargeMappedString)
+    ->RangeMultiplier(16)
+    ->Range(1 << 10, 1 << 22);
+
+// ------------------------------------------------------------------------
+// Validation
+// ------------------------------------------------------------------------
+
+static void BM_ValidateFlags(benchmark::State &state) {
+  SyntheticRegistry flags(state.range(0));
+  Gflags gflags;
+  CommandLineFlagParser parser(&gflags, flags.registry());
+  for (auto _ : state)
+    parser.ValidateFlags(true);
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ValidateFlags)->RangeMultiplier(10)->Range(100, 100000);
+
+// ------------------------------------------------------------------------
+// Locking
+//    The registry lock alone, then under a short critical section
+//    (FindFlagLocked), sharded sets of unrelated flags, and a long
+//    critical section (ValidateFlags over 10000 flags), with 1 to 8
+//    threads sharing one registry.
+// ------------------------------------------------------------------------
+
+static void BM_MutexLock(benchmark::State &state) {
+  gflags::Mutex mu;
+  for (auto _ : state) {
+    mu.Lock();
+    mu.Unlock();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MutexLock);
+
+static void BM_MutexReaderLock(benchmark::State &state) {
+  gflags::Mutex mu;
+  for (auto _ : state) {
+    mu.ReaderLock();
+    mu.ReaderUnlock();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MutexReaderLock);
+
+static SyntheticRegistry *SharedRegistry() {
+  static SyntheticRegistry *flags = new SyntheticRegistry(10000);
+  return flags;
+}
+
+static void BM_ContendedFindFlag(benchmark::State &state) {
+  SyntheticRegistry *flags = SharedRegistry();
+  const vector<string> &names = flags->names();
+  size_t i = state.thread_index() * 997;
+  for (auto _ : state) {
+    FlagRegistryLock frl(flags->registry());
+    benchmark::DoNotOptimize(
+        flags->registry()->FindFlagLocked(names[i % names.size()].c_str()));
+    ++i;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ContendedFindFlag)->ThreadRange(1, 8)->UseRealTime();
+
+// Each thread sets its own flag, the way Gflags::SetCommandLineOption()
+// does: registry lock shared, the flag's shards exclusive.
+static void BM_ContendedSetFlag(benchmark::State &state) {
+  SyntheticRegistry *flags = SharedRegistry();
+  FlagRegistry *registry = flags->registry();
+  CommandLineFlag *flag;
+  {
+    FlagRegistryLock frl(registry);
+    // Odd indexes never carry a constraint.
+    flag = registry->FindFlagLocked(
+        flags->names()[2 * state.thread_index() + 1].c_str());
+  }
+  string msg;
+  bool odd = false;
+  for (auto _ : state) {
+    odd = !odd;
+    FlagRegistryReaderLock frl(registry);
+    FlagShardLock fsl(registry, registry->SetShardMaskLocked(flag), true);
+    benchmark::DoNotOptimize(registry->SetFlagLocked(
+        flag, odd ? "1" : "2", SET_FLAGS_VALUE, &msg));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ContendedSetFlag)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_ContendedValidateFlags(benchmark::State &state) {
+  SyntheticRegistry *flags = SharedRegistry();
+  Gflags gflags;
+  CommandLineFlagParser parser(&gflags, flags->registry());
+  for (auto _ : state)
+    parser.ValidateFlags(true);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ContendedValidateFlags)->ThreadRange(1, 8)->UseRealTime();
+
+BENCHMARK_MAIN();
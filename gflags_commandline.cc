@@ -3,8 +3,11 @@
 using gflags::clstring;
 using gflags::CommandLineFlag;
 using gflags::CommandLineFlagParser;
+using gflags::CrossFlagConstraint;
 using gflags::DieWhenReporting;
+using gflags::FlagConstraint;
 using gflags::FlagRegistry;
+using gflags::FlagTable;
 using gflags::int32;
 using gflags::int64;
 using gflags::uint32;
@@ -12,7 +15,9 @@ using gflags::uint64;
 using gflags::ValidateFnProto;
 using gflags::ValueType;
 using std::cout;
+using std::pair;
 using std::string;
+using std::vector;
 
 // --------------------------------------------------------------------
 // CommandLineFlag
@@ -28,8 +33,8 @@ using std::string;
 CommandLineFlag::CommandLineFlag(const char *name, const char *help,
                                  const char *filename, FlagValue *current_val,
                                  FlagValue *default_val)
-    : name_(name), help_(help), file_(filename), modified_(false),
-      defvalue_(default_val), current_(current_val), validate_fn_proto_(NULL) {}
+    : name_(name), help_(help), file_(filename), defvalue_(default_val),
+      current_(current_val), table_(NULL), index_(0) {}
 
 CommandLineFlag::~CommandLineFlag() {
   delete current_;
@@ -60,7 +65,11 @@ string CommandLineFlag::default_value() const { return defvalue_->ToString(); }
 const char *CommandLineFlag::type_name() const { return defvalue_->TypeName(); }
 
 ValidateFnProto CommandLineFlag::validate_function() const {
-  return validate_fn_proto_;
+  return table_->validate_fn_[index_];
+}
+
+const FlagConstraint *CommandLineFlag::constraint() const {
+  return table_->constraint_[index_];
 }
 
 const void *CommandLineFlag::flag_ptr() const {
@@ -70,36 +79,89 @@ const void *CommandLineFlag::flag_ptr() const {
 ValueType CommandLineFlag::Type() const { return defvalue_->Type(); }
 
 bool CommandLineFlag::Validate(const FlagValue &value) const {
+  if (constraint() != NULL && !value.Satisfies(*constraint()))
+    return false;
+  return CallValidator(value);
+}
+
+bool CommandLineFlag::CallValidator(const FlagValue &value) const {
   if (validate_function() == NULL)
     return true;
-  else
-    return value.Validate(name(), validate_function());
+  GFLAGS_STATS_INC(table_->stats_->validator_calls);
+  if (!value.Validate(name(), validate_function())) {
+    GFLAGS_STATS_INC(table_->stats_->validator_failures);
+    return false;
+  }
+  return true;
 }
 
-bool CommandLineFlag::ValidateCurrent() const { return Validate(*current_); }
+bool CommandLineFlag::ValidateCurrent() const {
+  if (!(table_->state_[index_] & FlagTable::kChecked))
+    return true;
+  // An unset flag still holds its default, whose verdict we may already know.
+  if (current_->Equal(*defvalue_))
+    return ValidateDefault();
+  return Validate(*current_);
+}
 
-bool CommandLineFlag::Modified() const { return modified_; }
+bool CommandLineFlag::ValidateDefault() const {
+  uint8 &state = table_->state_[index_];
+  if (!(state & FlagTable::kChecked))
+    return true;
+  if (!(state & (FlagTable::kDefaultValid | FlagTable::kDefaultInvalid))) {
+    state |= Validate(*defvalue_) ? FlagTable::kDefaultValid
+                                  : FlagTable::kDefaultInvalid;
+  }
+  return (state & FlagTable::kDefaultValid) != 0;
+}
+
+bool CommandLineFlag::Modified() const {
+  return (table_->state_[index_] & FlagTable::kModified) != 0;
+}
 
 void CommandLineFlag::CopyFrom(const CommandLineFlag &src) {
   // Note we only copy the non-const members; others are fixed at construct time
-  if (modified_ != src.modified_)
-    modified_ = src.modified_;
+  if (Modified() != src.Modified())
+    set_modified(src.Modified());
   if (!current_->Equal(*src.current_))
     current_->CopyFrom(*src.current_);
-  if (!defvalue_->Equal(*src.defvalue_))
+  if (!defvalue_->Equal(*src.defvalue_)) {
     defvalue_->CopyFrom(*src.defvalue_);
-  if (validate_fn_proto_ != src.validate_fn_proto_)
-    validate_fn_proto_ = src.validate_fn_proto_;
+    InvalidateDefaultValidation();
+  }
+  if (validate_function() != src.validate_function())
+    set_validate_function(src.validate_function());
 }
 
 void CommandLineFlag::UpdateModifiedBit() {
   // Update the "modified" bit in case somebody bypassed the
   // Flags API and wrote directly through the FLAGS_name variable.
-  if (!modified_ && !current_->Equal(*defvalue_)) {
-    modified_ = true;
+  if (!Modified() && !current_->Equal(*defvalue_)) {
+    set_modified(true);
   }
 }
 
+void CommandLineFlag::set_modified(bool modified) {
+  if (modified)
+    table_->state_[index_] |= FlagTable::kModified;
+  else
+    table_->state_[index_] &= ~FlagTable::kModified;
+}
+
+void CommandLineFlag::set_validate_function(ValidateFnProto validate_fn_proto) {
+  table_->validate_fn_[index_] = validate_fn_proto;
+  if (validate_fn_proto != NULL || constraint() != NULL)
+    table_->state_[index_] |= FlagTable::kChecked;
+  else
+    table_->state_[index_] &= ~FlagTable::kChecked;
+  InvalidateDefaultValidation();
+}
+
+void CommandLineFlag::InvalidateDefaultValidation() {
+  table_->state_[index_] &=
+      ~(FlagTable::kDefaultValid | FlagTable::kDefaultInvalid);
+}
+
 // --------------------------------------------------------------------
 // CommandLineFlagParser
 //    Parsing is done in two stages.  In the first, we go through
@@ -115,8 +177,14 @@ void CommandLineFlag::UpdateModifiedBit() {
 //    is handled as soon as it's seen in stage 1, not in stage 2.
 // --------------------------------------------------------------------
 
+// error_flags_ is keyed by flag name.  Cross-flag constraint errors are
+// kept under "constraint:<name>", which no flag name can collide with.
+static string ConstraintErrorKey(const string &name) {
+  return "constraint:" + name;
+}
+
 CommandLineFlagParser::CommandLineFlagParser(Gflags *enter, FlagRegistry *reg)
-    : enter_(enter), registry_(reg) {}
+    : enter_(enter), registry_(reg), batch_(0) {}
 
 CommandLineFlagParser::~CommandLineFlagParser() {}
 
@@ -125,6 +193,8 @@ uint32 CommandLineFlagParser::ParseNewCommandLineFlags(int *argc, char ***argv,
   int first_nonopt = *argc; // for non-options moved to the end
 
   registry_->Lock();
+  // Cross-flag constraints see the commandline as a whole.
+  batch_ = registry_->BeginBatchLocked();
   for (int i = 1; i < first_nonopt; i++) {
     char *arg = (*argv)[i];
 
@@ -197,6 +267,11 @@ uint32 CommandLineFlagParser::ParseNewCommandLineFlags(int *argc, char ***argv,
     // TODO(csilvers): only set a flag if we hadn't set it before here
     ProcessSingleOptionLocked(flag, value, SET_FLAGS_VALUE);
   }
+  vector<pair<string, string> > constraint_errors;
+  registry_->EndBatchLocked(&constraint_errors);
+  for (size_t i = 0; i < constraint_errors.size(); ++i)
+    error_flags_[ConstraintErrorKey(constraint_errors[i].first)] =
+        constraint_errors[i].second;
   registry_->Unlock();
 
   if (remove_flags) { // Fix up argc and argv by removing command line flags
@@ -222,24 +297,55 @@ string CommandLineFlagParser::ProcessSingleOptionLocked(
 
 void CommandLineFlagParser::ValidateFlags(bool all) {
   FlagRegistryLock frl(registry_);
-  for (FlagRegistry::FlagConstIterator i = registry_->flags_.begin();
-       i != registry_->flags_.end(); ++i) {
-    if ((all || !i->second->Modified()) && !i->second->ValidateCurrent()) {
+  // Walk the dense state bytes; only flags with a validator or a
+  // constraint are dereferenced.
+  const FlagTable &table = registry_->table_;
+  const uint8 skip = all ? 0 : FlagTable::kModified;
+  for (uint32 i = 0; i < table.size(); ++i) {
+    const uint8 state = table.state_[i];
+    if (!(state & FlagTable::kChecked) || (state & skip))
+      continue;
+    const CommandLineFlag *flag = table.flags_[i];
+    if (!flag->ValidateCurrent()) {
       // only set a message if one isn't already there.  (If there's
       // an error message, our job is done, even if it's not exactly
       // the same error.)
-      if (error_flags_[i->second->name()].empty()) {
-        error_flags_[i->second->name()] = string(kError) + "--" +
-                                          i->second->name() +
-                                          " must be set on the commandline";
-        if (!i->second->Modified()) {
-          error_flags_[i->second->name()] +=
-              " (default value fails validation)";
+      if (error_flags_[flag->name()].empty()) {
+        error_flags_[flag->name()] = string(kError) + "--" + flag->name() +
+                                     " must be set on the commandline";
+        if (!flag->Modified()) {
+          error_flags_[flag->name()] += " (default value fails validation)";
         }
-        error_flags_[i->second->name()] += "\n";
+        error_flags_[flag->name()] += "\n";
       }
     }
   }
+  for (size_t i = 0; i < registry_->cross_constraints_.size(); ++i) {
+    const CrossFlagConstraint *constraint = registry_->cross_constraints_[i];
+    // One the commandline's batch evaluated has been reported already.
+    if (batch_ != 0 && constraint->checked_batch == batch_)
+      continue;
+    bool check = all;
+    for (size_t j = 0; !check && j < constraint->flags.size(); ++j)
+      check = !constraint->flags[j]->Modified();
+    if (!check || registry_->CheckCrossConstraintLocked(constraint))
+      continue;
+    string &error = error_flags_[ConstraintErrorKey(constraint->name)];
+    if (error.empty())
+      error = string(kError) + "flags violate constraint '" + constraint->name +
+              "'\n";
+  }
 }
 
 void CommandLineFlagParser::ValidateUnmodifiedFlags() { ValidateFlags(false); }
+
+bool CommandLineFlagParser::ReportErrors() {
+  string error_message;
+  for (map<string, string>::const_iterator it = error_flags_.begin();
+       it != error_flags_.end(); ++it)
+    error_message += it->second;
+  if (error_message.empty())
+    return false;
+  ReportError(DO_NOT_DIE, "%s", error_message.c_str());
+  return true;
+}
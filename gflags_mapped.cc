@@ -0,0 +1,87 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gflags.h"
+
+using gflags::FlagTypeTraits;
+using gflags::int64;
+using gflags::MappedBuffer;
+using gflags::MappedString;
+using std::string;
+
+// --------------------------------------------------------------------
+// MappedString
+//    Buffers are immutable once published, so a View can be read with
+//    no lock; only the shared_ptr in a MappedString changes, atomically.
+// --------------------------------------------------------------------
+
+MappedBuffer::~MappedBuffer() {
+  if (mapped_)
+    munmap(const_cast<char *>(data_), size_);
+}
+
+MappedString::MappedString() : buffer_(new MappedBuffer) {}
+
+bool MappedString::operator==(const MappedString &x) const {
+  const View a = Get(), b = x.Get();
+  if (a == b)
+    return true;
+  if (a->size() != b->size() || a->path() != b->path())
+    return false;
+  if (!a->path().empty())
+    return a->dev_ == b->dev_ && a->ino_ == b->ino_ &&
+           a->mtime_ns_ == b->mtime_ns_;
+  return memcmp(a->data(), b->data(), a->size()) == 0;
+}
+
+bool FlagTypeTraits<MappedString>::Parse(const char *text,
+                                         MappedString *value) {
+  std::shared_ptr<MappedBuffer> buffer(new MappedBuffer);
+  if (text[0] != '@' || text[1] == '@') {
+    buffer->literal_ = text[0] == '@' ? text + 1 : text;
+    buffer->data_ = buffer->literal_.c_str();
+    buffer->size_ = buffer->literal_.size();
+  } else {
+    buffer->path_ = text + 1;
+    int fd;
+    do {
+      fd = open(buffer->path_.c_str(), O_RDONLY | O_CLOEXEC);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      return false;
+    }
+    buffer->dev_ = st.st_dev;
+    buffer->ino_ = st.st_ino;
+    buffer->mtime_ns_ =
+        static_cast<int64>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    // mmap() refuses an empty length; an empty file is just "".
+    if (st.st_size > 0) {
+      void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        close(fd);
+        return false;
+      }
+      buffer->data_ = static_cast<const char *>(p);
+      buffer->size_ = st.st_size;
+      buffer->mapped_ = true;
+    }
+    close(fd); // the mapping holds its own reference to the file
+  }
+  std::atomic_store(&value->buffer_, MappedString::View(buffer));
+  return true;
+}
+
+string FlagTypeTraits<MappedString>::Format(const MappedString &value) {
+  const MappedString::View buffer = value.Get();
+  if (!buffer->path().empty())
+    return "@" + buffer->path();
+  // Escape a literal that would read back as a file.
+  const string literal(buffer->data(), buffer->size());
+  return literal[0] == '@' ? "@" + literal : literal;
+}
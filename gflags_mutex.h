@@ -4,8 +4,22 @@
 #include <stdlib.h>
 #include <pthread.h>
 
+#if defined(GFLAGS_FUTEX_MUTEX)
+#if !defined(__linux__)
+#error "GFLAGS_FUTEX_MUTEX needs Linux futexes"
+#endif
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <atomic>
+#endif
+
+#include "gflags_stats.h"
+
 namespace gflags {
 
+#if !defined(GFLAGS_FUTEX_MUTEX)
 typedef pthread_rwlock_t MutexType;
 
 #define SAFE_PTHREAD(fncall)                                                   \
@@ -13,47 +27,76 @@ typedef pthread_rwlock_t MutexType;
     if (is_safe_ && fncall(&mutex_) != 0)                                      \
       abort();                                                                 \
   } while (0)
+#endif
 
+// A reader-writer lock.  By default it wraps pthread_rwlock_t; built
+// with GFLAGS_FUTEX_MUTEX it is a single futex word instead, which spins
+// briefly before sleeping and skips glibc's rwlock bookkeeping on the
+// uncontended path.
+//   Either way, a waiting writer holds off new readers, so that a steady
+// stream of readers cannot starve it.  The flip side is that a thread
+// must not take a shared lock it already holds shared.
 class Mutex {
 public:
   // This is used for the single-arg constructor
   enum LinkerInitialized { LINKER_INITIALIZED };
 
+#if defined(GFLAGS_FUTEX_MUTEX)
+  inline Mutex() : state_(0), spin_average_(0) {}
+  explicit inline Mutex(LinkerInitialized) : state_(0), spin_average_(0) {}
+#else
   // Create a Mutex that is not held by anybody.  This constructor is
   // typically used for Mutexes allocated on the heap or the stack.
-  inline Mutex() : destroy_(true) {
-    SetIsSafe();
-    if (is_safe_ && pthread_rwlock_init(&mutex_, NULL) != 0)
-      abort();
-  }
+  inline Mutex() : destroy_(true) { Init(); }
 
   // This constructor should be used for global, static Mutex objects.
   // It inhibits work being done by the destructor, which makes it
   // safer for code that tries to acqiure this mutex in their global
   // destructor.
-  explicit inline Mutex(LinkerInitialized) : destroy_(false) {
-    SetIsSafe();
-    if (is_safe_ && pthread_rwlock_init(&mutex_, NULL) != 0)
-      abort();
-  }
+  explicit inline Mutex(LinkerInitialized) : destroy_(false) { Init(); }
 
   // Destructor
   inline ~Mutex() {
     if (destroy_)
       SAFE_PTHREAD(pthread_rwlock_destroy);
   }
+#endif
 
-  // Block if needed until free then acquire exclusively
-  inline void Lock() { SAFE_PTHREAD(pthread_rwlock_wrlock); }
+#if defined(GFLAGS_ENABLE_STATS)
+  // Try first, so that only acquisitions which actually block pay for
+  // reading the clock.
+  inline void Lock() {
+    if (!TryLockImpl()) {
+      const uint64_t start = MonotonicNanos();
+      LockImpl();
+      RecordWait(MonotonicNanos() - start);
+    }
+    GFLAGS_STATS_INC(stats_.acquisitions);
+  }
 
-  // Release a lock acquired via Lock()
-  inline void Unlock() { SAFE_PTHREAD(pthread_rwlock_unlock); }
+  inline void ReaderLock() {
+    if (!TryReaderLockImpl()) {
+      const uint64_t start = MonotonicNanos();
+      ReaderLockImpl();
+      RecordWait(MonotonicNanos() - start);
+    }
+    GFLAGS_STATS_INC(stats_.acquisitions);
+  }
+
+  const MutexStats &stats() const { return stats_; }
+#else
+  // Block if needed until free then acquire exclusively
+  inline void Lock() { LockImpl(); }
 
   // Block until free or shared then acquire a share
-  inline void ReaderLock() { SAFE_PTHREAD(pthread_rwlock_rdlock); }
+  inline void ReaderLock() { ReaderLockImpl(); }
+#endif
+
+  // Release a lock acquired via Lock()
+  inline void Unlock() { UnlockImpl(); }
 
   // Release a read share of this Mutex
-  inline void ReaderUnlock() { SAFE_PTHREAD(pthread_rwlock_unlock); }
+  inline void ReaderUnlock() { ReaderUnlockImpl(); }
 
   // Acquire an exclusive lock
   inline void WriterLock() { Lock(); }
@@ -62,6 +105,119 @@ public:
   inline void WriterUnlock() { Unlock(); }
 
 private:
+#if defined(GFLAGS_FUTEX_MUTEX)
+  // state_ holds the reader count in the low bits, plus kWriter while
+  // held exclusively, kWaiters while somebody may be asleep on it, and
+  // kWriterWaiting while that somebody may be a writer, which keeps new
+  // readers out.  Releasing a lock with kWaiters set clears both waiting
+  // bits and wakes every sleeper; those that lose the race set them
+  // again before sleeping, so no sleeper is ever left without a waker.
+  static const uint32_t kWriter = 1u << 31;
+  static const uint32_t kWaiters = 1u << 30;
+  static const uint32_t kWriterWaiting = 1u << 29;
+  static const uint32_t kReaders = kWriterWaiting - 1;
+  // Upper bound on spinning before sleeping; see SpinLimit().
+  static const int32_t kMaxSpins = 100;
+
+  std::atomic<uint32_t> state_;
+  // Running average of how long LockSlow() spun, in the manner of
+  // glibc's PTHREAD_MUTEX_ADAPTIVE_NP: the more spinning a lock has
+  // needed lately, the longer the next waiter spins before sleeping.
+  std::atomic<int32_t> spin_average_;
+
+  inline bool TryLockImpl() {
+    uint32_t s = state_.load(std::memory_order_relaxed);
+    return (s & (kWriter | kReaders)) == 0 &&
+           state_.compare_exchange_strong(s, s | kWriter,
+                                          std::memory_order_acquire);
+  }
+
+  inline bool TryReaderLockImpl() {
+    uint32_t s = state_.load(std::memory_order_relaxed);
+    return (s & (kWriter | kWriterWaiting)) == 0 &&
+           state_.compare_exchange_strong(s, s + 1, std::memory_order_acquire);
+  }
+
+  inline void LockImpl() {
+    if (!TryLockImpl())
+      LockSlow(kWriter | kReaders, kWriter, kWaiters | kWriterWaiting);
+  }
+
+  inline void ReaderLockImpl() {
+    if (!TryReaderLockImpl())
+      LockSlow(kWriter | kWriterWaiting, 1, kWaiters);
+  }
+
+  inline void UnlockImpl() {
+    if (state_.exchange(0, std::memory_order_release) & kWaiters)
+      Wake();
+  }
+
+  inline void ReaderUnlockImpl() {
+    uint32_t s = state_.fetch_sub(1, std::memory_order_release) - 1;
+    // The last reader out wakes the sleepers, unless someone got in
+    // first; then that one's release does it.
+    while ((s & (kWriter | kReaders)) == 0 && (s & kWaiters)) {
+      if (state_.compare_exchange_weak(s, 0, std::memory_order_relaxed)) {
+        Wake();
+        return;
+      }
+    }
+  }
+
+  // Waits until none of the busy bits are set, then adds add.  Sets the
+  // waiting bits before going to sleep.
+  void LockSlow(uint32_t busy, uint32_t add, uint32_t waiting) {
+    const int32_t limit = SpinLimit();
+    int32_t spins = 0;
+    for (;;) {
+      uint32_t s = state_.load(std::memory_order_relaxed);
+      if ((s & busy) == 0) {
+        if (state_.compare_exchange_weak(s, s + add,
+                                         std::memory_order_acquire)) {
+          const int32_t spun = spins < limit ? spins : limit;
+          const int32_t avg = spin_average_.load(std::memory_order_relaxed);
+          spin_average_.store(avg + (spun - avg) / 8,
+                              std::memory_order_relaxed);
+          return;
+        }
+        continue;
+      }
+      if (spins++ < limit) {
+        CpuRelax();
+        continue;
+      }
+      if ((s & waiting) != waiting &&
+          !state_.compare_exchange_weak(s, s | waiting,
+                                        std::memory_order_relaxed)) {
+        continue;
+      }
+      syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_),
+              FUTEX_WAIT_PRIVATE, s | waiting, NULL, NULL, 0);
+    }
+  }
+
+  inline void Wake() {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&state_),
+            FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+  }
+
+  // Spinning only helps if the holder is running on another CPU.
+  inline int32_t SpinLimit() const {
+    static const bool multi_cpu = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    if (!multi_cpu)
+      return 0;
+    const int32_t limit =
+        2 * spin_average_.load(std::memory_order_relaxed) + 10;
+    return limit < kMaxSpins ? limit : kMaxSpins;
+  }
+
+  static inline void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  }
+#else
   pthread_rwlock_t mutex_;
   // We want to make sure that the compiler sets is_safe_ to true only
   // when we tell it to, and never makes assumptions is_safe_ is
@@ -72,6 +228,42 @@ private:
 
   inline void SetIsSafe() { is_safe_ = true; }
 
+  inline void Init() {
+    SetIsSafe();
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#if defined(__GLIBC__)
+    // glibc prefers readers by default.
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    if (is_safe_ && pthread_rwlock_init(&mutex_, &attr) != 0)
+      abort();
+    pthread_rwlockattr_destroy(&attr);
+  }
+
+  inline bool TryLockImpl() {
+    return !is_safe_ || pthread_rwlock_trywrlock(&mutex_) == 0;
+  }
+  inline bool TryReaderLockImpl() {
+    return !is_safe_ || pthread_rwlock_tryrdlock(&mutex_) == 0;
+  }
+  inline void LockImpl() { SAFE_PTHREAD(pthread_rwlock_wrlock); }
+  inline void ReaderLockImpl() { SAFE_PTHREAD(pthread_rwlock_rdlock); }
+  inline void UnlockImpl() { SAFE_PTHREAD(pthread_rwlock_unlock); }
+  inline void ReaderUnlockImpl() { SAFE_PTHREAD(pthread_rwlock_unlock); }
+#endif
+
+#if defined(GFLAGS_ENABLE_STATS)
+  MutexStats stats_;
+
+  inline void RecordWait(uint64_t ns) {
+    GFLAGS_STATS_INC(stats_.contended);
+    stats_.wait_ns.fetch_add(ns, std::memory_order_relaxed);
+    stats_.wait_histogram.Record(ns);
+  }
+#endif
+
   // Catch the error of writing Mutex when intending MutexLock.
   explicit Mutex(Mutex * /*ignored*/) {}
   // Disallow "evil" constructors
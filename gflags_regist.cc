@@ -1,9 +1,16 @@
+#include <new>
 #include "gflags.h"
 
 using gflags::clstring;
 using gflags::CommandLineFlag;
+using gflags::CrossFlagConstraint;
 using gflags::FlagRegistry;
+using gflags::FlagConstraint;
 using gflags::FlagRegistryLock;
+using gflags::FlagRegistryReaderLock;
+using gflags::FlagShardLock;
+using gflags::FlagStats;
+using gflags::FlagTable;
 using gflags::FlagValue;
 using gflags::int32;
 using gflags::int64;
@@ -11,6 +18,7 @@ using gflags::uint32;
 using gflags::uint64;
 using std::pair;
 using std::string;
+using std::vector;
 
 // --------------------------------------------------------------------
 // FlagRegistry
@@ -19,13 +27,20 @@ using std::string;
 //    string), you can access or set it.  If the function is named
 //    FooLocked(), you must own the registry lock before calling
 //    the function; otherwise, you should *not* hold the lock, and
-//    the function will acquire it itself if needed.
+//    the function will acquire it itself if needed.  See "Locking" in
+//    gflags.h for when a shared hold plus shard locks is enough.
 // --------------------------------------------------------------------
 
 // Get the singleton FlagRegistry object
 FlagRegistry *FlagRegistry::global_registry_ = NULL;
 
-FlagRegistry::FlagRegistry() {}
+FlagRegistry::FlagRegistry()
+    : flags_by_ptr_sorted_(true), batch_open_(false), batches_(0),
+      generation_(0) {
+#if defined(GFLAGS_ENABLE_STATS)
+  table_.stats_ = &stats_;
+#endif
+}
 
 FlagRegistry::~FlagRegistry() {
   // Not using STLDeleteElements as that resides in util and this
@@ -34,8 +49,19 @@ FlagRegistry::~FlagRegistry() {
     CommandLineFlag *flag = p->second;
     delete flag;
   }
+  for (size_t i = 0; i < cross_constraints_.size(); ++i)
+    delete cross_constraints_[i];
+}
+
+void *FlagRegistry::operator new(size_t size) {
+  void *p;
+  if (posix_memalign(&p, GFLAGS_CACHELINE_SIZE, size) != 0)
+    throw std::bad_alloc();
+  return p;
 }
 
+void FlagRegistry::operator delete(void *p) { free(p); }
+
 FlagRegistry *FlagRegistry::GlobalRegistry() {
   static Mutex lock(Mutex::LINKER_INITIALIZED);
   MutexLock acquire_lock(&lock);
@@ -54,12 +80,37 @@ void FlagRegistry::Lock() { lock_.Lock(); }
 
 void FlagRegistry::Unlock() { lock_.Unlock(); }
 
-void FlagRegistry::RegisterFlag(CommandLineFlag *flag) {
+void FlagRegistry::ReaderLock() { lock_.ReaderLock(); }
+
+void FlagRegistry::ReaderUnlock() { lock_.ReaderUnlock(); }
+
+uint32 FlagRegistry::ShardBit(const CommandLineFlag *flag) {
+  static_assert(kNumShards <= 32, "shard masks are uint32");
+  return 1u << (flag->index_ % kNumShards);
+}
+
+uint32 FlagRegistry::SetShardMaskLocked(const CommandLineFlag *flag) const {
+  uint32 mask = ShardBit(flag);
+  ConstraintIndex::const_iterator deps = constraints_by_flag_.find(flag);
+  if (deps != constraints_by_flag_.end()) {
+    const CrossFlagConstraints &constraints = deps->second;
+    for (size_t i = 0; i < constraints.size(); ++i) {
+      for (size_t j = 0; j < constraints[i]->flags.size(); ++j)
+        mask |= ShardBit(constraints[i]->flags[j]);
+    }
+  }
+  return mask;
+}
+
+void FlagRegistry::RegisterFlag(CommandLineFlag *flag,
+                                const FlagConstraint *constraint) {
   Lock();
+  FlagFile *file = InternFileLocked(flag->file_);
+  flag->file_ = file->name;
   pair<FlagIterator, bool> ins =
       flags_.insert(pair<const char *, CommandLineFlag *>(flag->name(), flag));
   if (ins.second == false) { // means the name was already in the map
-    if (strcmp(ins.first->second->filename(), flag->filename()) != 0) {
+    if (ins.first->second->filename() != flag->filename()) { // interned
       ReportError(DIE,
                   "ERROR: flag '%s' was defined more than once "
                   "(in files '%s' and '%s').\n",
@@ -73,35 +124,97 @@ void FlagRegistry::RegisterFlag(CommandLineFlag *flag) {
                   flag->name(), flag->filename(), flag->filename());
     }
   }
-  // Also add to the flags_by_ptr_ map.
-  flags_by_ptr_[flag->current_->value_buffer_] = flag;
+  if (constraint != NULL) {
+    if (constraint->Empty()) {
+      ReportError(DIE, "ERROR: flag '%s' has the empty constraint %s\n",
+                  flag->name(), constraint->ToString().c_str());
+    }
+    if (!flag->defvalue_->Satisfies(*constraint)) {
+      ReportError(DIE,
+                  "ERROR: default value '%s' of flag '%s' is not in %s\n",
+                  flag->defvalue_->ToString().c_str(), flag->name(),
+                  constraint->ToString().c_str());
+    }
+  }
+  table_.Append(flag, constraint);
+  file->flags.push_back(flag);
+  if (!suggester_.empty())
+    suggester_.Add(flag->name());
+  // Also add to the flags_by_ptr_ index.
+  flags_by_ptr_.push_back(FlagPtrEntry(flag->current_->value_buffer_, flag));
+  flags_by_ptr_sorted_ = false;
   Unlock();
 }
 
+FlagRegistry::FlagFile *
+FlagRegistry::InternFileLocked(const char *filename) {
+  FileAddressMap::const_iterator i = files_by_address_.find(filename);
+  if (i != files_by_address_.end())
+    return i->second;
+  // First flag from this literal: fall back to comparing paths.
+  FlagFile *file = &files_[filename];
+  if (file->name == NULL)
+    file->name = filename;
+  files_by_address_[filename] = file;
+  return file;
+}
+
 CommandLineFlag *FlagRegistry::FindFlagLocked(const char *name) {
+  GFLAGS_STATS_INC(stats_.lookups);
+  GFLAGS_STATS_TIMER(timer, stats_.lookup_ns);
   FlagConstIterator i = flags_.find(name);
-  if (i == flags_.end()) {
+  if (i == flags_.end() && strchr(name, '-') != NULL) {
     // If the name has dashes in it, try again after replacing with
     // underscores.
-    if (strchr(name, '-') == NULL)
-      return NULL;
     string name_rep = name;
     std::replace(name_rep.begin(), name_rep.end(), '-', '_');
-    return FindFlagLocked(name_rep.c_str());
-  } else {
-    return i->second;
+    i = flags_.find(name_rep.c_str());
+  }
+  if (i == flags_.end()) {
+    GFLAGS_STATS_INC(stats_.lookup_misses);
+    return NULL;
   }
+  return i->second;
 }
 
 CommandLineFlag *FlagRegistry::FindFlagViaPtrLocked(const void *flag_ptr) {
-  FlagPtrMap::const_iterator i = flags_by_ptr_.find(flag_ptr);
-  if (i == flags_by_ptr_.end()) {
+  if (!flags_by_ptr_sorted_) {
+    std::sort(flags_by_ptr_.begin(), flags_by_ptr_.end());
+    flags_by_ptr_sorted_ = true;
+  }
+  vector<FlagPtrEntry>::const_iterator i =
+      std::lower_bound(flags_by_ptr_.begin(), flags_by_ptr_.end(),
+                       FlagPtrEntry(flag_ptr, NULL));
+  if (i == flags_by_ptr_.end() || i->first != flag_ptr) {
     return NULL;
   } else {
     return i->second;
   }
 }
 
+void FlagRegistry::GetFlagsMatchingLocked(
+    const char *pattern, vector<const CommandLineFlag *> *output) const {
+  const size_t prefix_len = strcspn(pattern, "*?[\\");
+  if (pattern[prefix_len] == '\0') { // no wildcard: a plain lookup
+    FlagConstIterator i = flags_.find(pattern);
+    if (i != flags_.end())
+      output->push_back(i->second);
+    return;
+  }
+  // Everything after the prefix, if it is a lone '*', matches anything.
+  const char *rest = pattern + prefix_len;
+  const bool any_rest = strcmp(rest, "*") == 0;
+  const string prefix(pattern, prefix_len);
+  for (FlagConstIterator i = flags_.lower_bound(prefix.c_str());
+       i != flags_.end() && strncmp(i->first, pattern, prefix_len) == 0;
+       ++i) {
+    // The prefix matched already; FNM_PERIOD is not set, so matching
+    // the rest against the rest of the name is the same as matching all.
+    if (any_rest || fnmatch(rest, i->first + prefix_len, 0) == 0)
+      output->push_back(i->second);
+  }
+}
+
 CommandLineFlag *FlagRegistry::SplitArgumentLocked(const char *arg, string *key,
                                                    const char **v,
                                                    string *error_message) {
@@ -127,15 +240,17 @@ CommandLineFlag *FlagRegistry::SplitArgumentLocked(const char *arg, string *key,
     // In that case, we want to return flag 'x'.
     if (!(flag_name[0] == 'n' && flag_name[1] == 'o')) {
       // flag-name is not 'nox', so we're not in the exception case.
-      *error_message = StringPrintf("%sunknown command line flag '%s'\n",
-                                    kError, key->c_str());
+      *error_message =
+          StringPrintf("%sunknown command line flag '%s'%s\n", kError,
+                       key->c_str(), SuggestFlagsLocked(flag_name).c_str());
       return NULL;
     }
     flag = FindFlagLocked(flag_name + 2);
     if (flag == NULL) {
       // No flag named 'x' exists, so we're not in the exception case.
-      *error_message = StringPrintf("%sunknown command line flag '%s'\n",
-                                    kError, key->c_str());
+      *error_message =
+          StringPrintf("%sunknown command line flag '%s'%s\n", kError,
+                       key->c_str(), SuggestFlagsLocked(flag_name).c_str());
       return NULL;
     }
     if (flag->Type() != FV_BOOL) {
@@ -161,21 +276,91 @@ CommandLineFlag *FlagRegistry::SplitArgumentLocked(const char *arg, string *key,
 
 bool FlagRegistry::SetFlagLocked(CommandLineFlag *flag, const char *value,
                                  FlagSettingMode set_mode, string *msg) {
+  GFLAGS_STATS_INC(stats_.sets);
+  GFLAGS_STATS_TIMER(timer, stats_.set_ns);
+  ConstraintIndex::const_iterator deps = constraints_by_flag_.find(flag);
+  bool changed;
+  if (deps == constraints_by_flag_.end()) {
+    if (!ApplyFlagLocked(flag, value, set_mode, msg, &changed)) {
+      GFLAGS_STATS_INC(stats_.set_failures);
+      return false;
+    }
+    if (changed)
+      generation_.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  const CrossFlagConstraints &constraints = deps->second;
+  if (batch_open_) {
+    // Checked once for the whole batch by EndBatchLocked().
+    for (size_t i = 0; i < constraints.size(); ++i) {
+      if (!constraints[i]->pending) {
+        constraints[i]->pending = true;
+        batch_pending_.push_back(constraints[i]);
+      }
+    }
+    if (!ApplyFlagLocked(flag, value, set_mode, msg, &changed)) {
+      GFLAGS_STATS_INC(stats_.set_failures);
+      return false;
+    }
+    if (changed)
+      generation_.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  // Save everything ApplyFlagLocked() may change, so that a violated
+  // constraint can be rolled back without anyone seeing the new value.
+  FlagValue *saved_current = flag->current_->New();
+  saved_current->CopyFrom(*flag->current_);
+  FlagValue *saved_default = flag->defvalue_->New();
+  saved_default->CopyFrom(*flag->defvalue_);
+  const bool saved_modified = flag->Modified();
+
+  bool ok = ApplyFlagLocked(flag, value, set_mode, msg, &changed);
+  for (size_t i = 0; ok && i < constraints.size(); ++i) {
+    if (!CheckCrossConstraintLocked(constraints[i])) {
+      if (msg) {
+        *msg = StringPrintf("%snew value '%s' for flag '%s' violates "
+                            "constraint '%s'\n",
+                            kError, value, flag->name(), constraints[i]->name);
+      }
+      flag->current_->CopyFrom(*saved_current);
+      if (!flag->defvalue_->Equal(*saved_default)) {
+        flag->defvalue_->CopyFrom(*saved_default);
+        flag->InvalidateDefaultValidation();
+      }
+      flag->set_modified(saved_modified);
+      ok = false;
+    }
+  }
+  delete saved_current;
+  delete saved_default;
+  if (!ok)
+    GFLAGS_STATS_INC(stats_.set_failures);
+  else if (changed) // only once the value can no longer be rolled back
+    generation_.fetch_add(1, std::memory_order_release);
+  return ok;
+}
+
+bool FlagRegistry::ApplyFlagLocked(CommandLineFlag *flag, const char *value,
+                                   FlagSettingMode set_mode, string *msg,
+                                   bool *changed) {
+  *changed = false;
   flag->UpdateModifiedBit();
   switch (set_mode) {
   case SET_FLAGS_VALUE: {
     // set or modify the flag's value
-    if (!TryParseLocked(flag, flag->current_, value, msg))
+    if (!TryParseLocked(flag, flag->current_, value, msg, changed))
       return false;
-    flag->modified_ = true;
+    flag->set_modified(true);
     break;
   }
   case SET_FLAG_IF_DEFAULT: {
     // set the flag's value, but only if it hasn't been set by someone else
-    if (!flag->modified_) {
-      if (!TryParseLocked(flag, flag->current_, value, msg))
+    if (!flag->Modified()) {
+      if (!TryParseLocked(flag, flag->current_, value, msg, changed))
         return false;
-      flag->modified_ = true;
+      flag->set_modified(true);
     } else {
       *msg = StringPrintf("%s set to %s", flag->name(),
                           flag->current_value().c_str());
@@ -184,11 +369,14 @@ bool FlagRegistry::SetFlagLocked(CommandLineFlag *flag, const char *value,
   }
   case SET_FLAGS_DEFAULT: {
     // modify the flag's default-value
-    if (!TryParseLocked(flag, flag->defvalue_, value, msg))
+    if (!TryParseLocked(flag, flag->defvalue_, value, msg, changed))
       return false;
-    if (!flag->modified_) {
+    flag->InvalidateDefaultValidation();
+    if (!flag->Modified()) {
       // Need to set both defvalue *and* current, in this case
-      TryParseLocked(flag, flag->current_, value, NULL);
+      bool current_changed = false;
+      TryParseLocked(flag, flag->current_, value, NULL, &current_changed);
+      *changed = *changed || current_changed;
     }
     break;
   }
@@ -202,6 +390,102 @@ bool FlagRegistry::SetFlagLocked(CommandLineFlag *flag, const char *value,
   return true;
 }
 
+void FlagRegistry::RegisterCrossFlagConstraintLocked(
+    CrossFlagConstraint *constraint) {
+  cross_constraints_.push_back(constraint);
+  for (size_t i = 0; i < constraint->flags.size(); ++i) {
+    CrossFlagConstraints &deps = constraints_by_flag_[constraint->flags[i]];
+    // A flag listed twice by the same constraint is indexed once.
+    if (std::find(deps.begin(), deps.end(), constraint) == deps.end())
+      deps.push_back(constraint);
+  }
+}
+
+uint64 FlagRegistry::BeginBatchLocked() {
+  assert(!batch_open_);
+  batch_open_ = true;
+  return ++batches_;
+}
+
+bool FlagRegistry::EndBatchLocked(vector<pair<string, string> > *errors) {
+  assert(batch_open_);
+  batch_open_ = false;
+  bool ok = true;
+  for (size_t i = 0; i < batch_pending_.size(); ++i) {
+    CrossFlagConstraint *constraint = batch_pending_[i];
+    constraint->pending = false;
+    constraint->checked_batch = batches_;
+    if (!CheckCrossConstraintLocked(constraint)) {
+      errors->push_back(pair<string, string>(
+          constraint->name, StringPrintf("%sflags violate constraint '%s'\n",
+                                         kError, constraint->name)));
+      ok = false;
+    }
+  }
+  batch_pending_.clear();
+  return ok;
+}
+
+bool FlagRegistry::CheckCrossConstraintLocked(
+    const CrossFlagConstraint *constraint) {
+  GFLAGS_STATS_INC(stats_.validator_calls);
+  if (!constraint->validate_fn()) {
+    GFLAGS_STATS_INC(stats_.validator_failures);
+    return false;
+  }
+  return true;
+}
+
+void FlagRegistry::GetStats(FlagStats *stats) const {
+  memset(stats, 0, sizeof(*stats));
+#if defined(GFLAGS_ENABLE_STATS)
+  stats->enabled = true;
+  stats->lookups = stats_.lookups.load(std::memory_order_relaxed);
+  stats->lookup_misses = stats_.lookup_misses.load(std::memory_order_relaxed);
+  stats->sets = stats_.sets.load(std::memory_order_relaxed);
+  stats->set_failures = stats_.set_failures.load(std::memory_order_relaxed);
+  stats->validator_calls =
+      stats_.validator_calls.load(std::memory_order_relaxed);
+  stats->validator_failures =
+      stats_.validator_failures.load(std::memory_order_relaxed);
+  stats_.lookup_ns.CopyTo(stats->lookup_ns);
+  stats_.set_ns.CopyTo(stats->set_ns);
+
+  const gflags::MutexStats &lock = lock_.stats();
+  stats->lock_acquisitions = lock.acquisitions.load(std::memory_order_relaxed);
+  stats->lock_contended = lock.contended.load(std::memory_order_relaxed);
+  stats->lock_wait_ns = lock.wait_ns.load(std::memory_order_relaxed);
+  lock.wait_histogram.CopyTo(stats->lock_wait_histogram_ns);
+
+  for (uint32 i = 0; i < kNumShards; ++i) {
+    const gflags::MutexStats &shard = shards_[i].lock.stats();
+    stats->shard_lock_acquisitions +=
+        shard.acquisitions.load(std::memory_order_relaxed);
+    stats->shard_lock_contended +=
+        shard.contended.load(std::memory_order_relaxed);
+    stats->shard_lock_wait_ns += shard.wait_ns.load(std::memory_order_relaxed);
+    uint64_t histogram[gflags::kStatsHistogramBuckets];
+    shard.wait_histogram.CopyTo(histogram);
+    for (int j = 0; j < gflags::kStatsHistogramBuckets; ++j)
+      stats->shard_lock_wait_histogram_ns[j] += histogram[j];
+  }
+#endif
+}
+
+// --------------------------------------------------------------------
+// FlagTable
+// --------------------------------------------------------------------
+
+void FlagTable::Append(CommandLineFlag *flag,
+                       const FlagConstraint *constraint) {
+  flag->table_ = this;
+  flag->index_ = size();
+  state_.push_back(constraint != NULL ? kChecked : 0);
+  validate_fn_.push_back(NULL);
+  constraint_.push_back(constraint);
+  flags_.push_back(flag);
+}
+
 // --------------------------------------------------------------------
 // FlagRegistryLock
 // --------------------------------------------------------------------
@@ -209,3 +493,38 @@ bool FlagRegistry::SetFlagLocked(CommandLineFlag *flag, const char *value,
 FlagRegistryLock::FlagRegistryLock(FlagRegistry *fr) : fr_(fr) { fr_->Lock(); }
 
 FlagRegistryLock::~FlagRegistryLock() { fr_->Unlock(); }
+
+FlagRegistryReaderLock::FlagRegistryReaderLock(FlagRegistry *fr) : fr_(fr) {
+  fr_->ReaderLock();
+}
+
+FlagRegistryReaderLock::~FlagRegistryReaderLock() { fr_->ReaderUnlock(); }
+
+// --------------------------------------------------------------------
+// FlagShardLock
+//    Shards are taken in ascending order, which is what keeps two
+//    multi-shard sets from deadlocking.
+// --------------------------------------------------------------------
+
+FlagShardLock::FlagShardLock(FlagRegistry *fr, uint32 mask, bool exclusive)
+    : fr_(fr), mask_(mask), exclusive_(exclusive) {
+  for (uint32 i = 0; i < FlagRegistry::kNumShards; ++i) {
+    if (!(mask_ & (1u << i)))
+      continue;
+    if (exclusive_)
+      fr_->shards_[i].lock.Lock();
+    else
+      fr_->shards_[i].lock.ReaderLock();
+  }
+}
+
+FlagShardLock::~FlagShardLock() {
+  for (uint32 i = FlagRegistry::kNumShards; i-- > 0;) {
+    if (!(mask_ & (1u << i)))
+      continue;
+    if (exclusive_)
+      fr_->shards_[i].lock.Unlock();
+    else
+      fr_->shards_[i].lock.ReaderUnlock();
+  }
+}
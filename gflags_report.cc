@@ -0,0 +1,225 @@
+#include <errno.h>
+#include <unistd.h>
+#include "gflags.h"
+
+using gflags::CommandLineFlag;
+using gflags::FlagRegistry;
+using gflags::FlagValue;
+using gflags::Gflags;
+using gflags::int32;
+using gflags::kStrippedFlagHelp;
+using std::string;
+using std::vector;
+
+DEFINE_bool(help, false,
+            "show help on all flags [tip: all flags can have two dashes]");
+DEFINE_bool(helpfull, false, "show help on all flags -- same as -help");
+DEFINE_string(helpon, "",
+              "show help on the modules named by this flag value");
+DEFINE_string(helpmatch, "",
+              "show help on modules whose name contains the specified substr");
+DEFINE_bool(version, false, "show version and build info and exit");
+
+// --------------------------------------------------------------------
+// ReportWriter
+//    Reports go straight to a file descriptor through one fixed buffer,
+//    so that --help on a registry of thousands of flags never holds more
+//    than a few kilobytes of output at a time.  A writer can hold the
+//    registry lock while formatting; it lets go for every write(2), so
+//    that a slow reader such as --help | less stalls only the report.
+// --------------------------------------------------------------------
+
+namespace {
+
+class ReportWriter {
+public:
+  explicit ReportWriter(int fd) : fd_(fd), len_(0), registry_(NULL) {}
+  ~ReportWriter() { Flush(); }
+
+  // Between these, registry's lock is held except while writing, so
+  // nothing read from the registry may be kept across an Append().
+  void LockRegistry(FlagRegistry *registry) {
+    registry->Lock();
+    registry_ = registry;
+  }
+  void UnlockRegistry() {
+    registry_->Unlock();
+    registry_ = NULL;
+  }
+
+  void Append(const char *s, size_t n) {
+    if (n > sizeof(buf_) - len_)
+      Flush();
+    if (n >= sizeof(buf_)) {
+      Write(s, n);
+      return;
+    }
+    memcpy(buf_ + len_, s, n);
+    len_ += n;
+  }
+  void Append(const char *s) { Append(s, strlen(s)); }
+  void Append(const string &s) { Append(s.data(), s.size()); }
+
+  void Flush() {
+    Write(buf_, len_);
+    len_ = 0;
+  }
+
+private:
+  void Write(const char *s, size_t n) {
+    if (n == 0)
+      return;
+    if (registry_)
+      registry_->Unlock();
+    while (n > 0) {
+      const ssize_t r = write(fd_, s, n);
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        break; // nobody to tell; a closed stdout loses the report
+      }
+      s += r;
+      n -= r;
+    }
+    if (registry_)
+      registry_->Lock();
+  }
+
+  const int fd_;
+  size_t len_;
+  FlagRegistry *registry_; // locked by LockRegistry(), if non-NULL
+  char buf_[4096];
+};
+
+bool FlagNameLess(const CommandLineFlag *a, const CommandLineFlag *b) {
+  return strcmp(a->name(), b->name()) < 0;
+}
+
+// The part of a report line describing a value: the value, in quotes
+// for strings.
+string DescribeValue(const CommandLineFlag *flag, const string &value) {
+  if (flag->Type() == gflags::FV_STRING)
+    return "\"" + value + "\"";
+  return value;
+}
+
+// Appends the description of one flag, in the layout of upstream gflags:
+//     -name (help) type: int32 default: 3
+// with the type part on a line of its own if the first one would pass
+// 80 columns.
+void DescribeOneFlag(ReportWriter *out, const CommandLineFlag *flag) {
+  const char *help = flag->help();
+  if (help[0] == kStrippedFlagHelp[0])
+    help = kStrippedFlagHelp + 5; // past the marker and the space
+  size_t column = 4 + 1 + strlen(flag->name()) + 2 + strlen(help) + 1;
+  out->Append("    -");
+  out->Append(flag->name());
+  out->Append(" (");
+  out->Append(help);
+  out->Append(")");
+
+  string type = " type: ";
+  type += flag->type_name();
+  type += " default: ";
+  type += DescribeValue(flag, flag->default_value());
+  if (flag->Modified()) {
+    const string current = flag->current_value();
+    if (current != flag->default_value())
+      type += " currently: " + DescribeValue(flag, current);
+  }
+  if (column + type.size() > 80)
+    out->Append("\n     ");
+  out->Append(type);
+  out->Append("\n");
+}
+
+// --helpon=module matches .../module.cc and module.cc.
+bool FileIsModule(const char *filename, const string &module) {
+  const char *base = strrchr(filename, '/');
+  base = base ? base + 1 : filename;
+  return strncmp(base, module.c_str(), module.size()) == 0 &&
+         base[module.size()] == '.';
+}
+
+} // namespace
+
+// --------------------------------------------------------------------
+// ShowUsageWithFlagsRestrict()
+//    Picks whole files out of the registry's per-file index, so only
+//    the flags that end up in the report are ever sorted or formatted.
+//    The lock is dropped whenever the writer flushes.  That is safe
+//    because flags and files are never removed: files_ is a map, whose
+//    iterators survive insertions, and each file's flags are copied out
+//    before any of them is described.
+// --------------------------------------------------------------------
+
+void Gflags::ShowUsageWithFlagsRestrict(int fd, const char *restrict,
+                                        bool module) {
+  ReportWriter out(fd);
+  out.Append(ProgramInvocationShortName());
+  out.Append(": ");
+  out.Append(ProgramUsage());
+  out.Append("\n");
+
+  const string selector = restrict ? restrict : "";
+  FlagRegistry *const registry = FlagRegistry::GlobalRegistry();
+  out.LockRegistry(registry);
+  bool found_match = false;
+  vector<const CommandLineFlag *> flags;
+  for (FlagRegistry::FileNameMap::const_iterator i = registry->files_.begin();
+       i != registry->files_.end(); ++i) {
+    const FlagRegistry::FlagFile &file = i->second;
+    if (module ? !FileIsModule(file.name, selector)
+               : strstr(file.name, selector.c_str()) == NULL) {
+      continue;
+    }
+    found_match = true;
+    flags.assign(file.flags.begin(), file.flags.end());
+    std::sort(flags.begin(), flags.end(), FlagNameLess);
+    out.Append("\n  Flags from ");
+    out.Append(file.name);
+    out.Append(":\n");
+    for (size_t j = 0; j < flags.size(); ++j)
+      DescribeOneFlag(&out, flags[j]);
+  }
+  out.UnlockRegistry();
+  if (!found_match && !selector.empty())
+    out.Append("\n  No modules matched: use -help\n");
+}
+
+void Gflags::ShowVersion(int fd) {
+  ReportWriter out(fd);
+  out.Append(ProgramInvocationShortName());
+  if (VersionString()[0] != '\0') {
+    out.Append(" version ");
+    out.Append(VersionString());
+  }
+  out.Append("\n");
+#if !defined(NDEBUG)
+  out.Append("Debug build (NDEBUG not #defined)\n");
+#endif
+}
+
+// --------------------------------------------------------------------
+// HandleCommandLineHelpFlags()
+//    Checks all the 'reporting' commandline flags to see if any
+//    have been set.  If so, handles them appropriately.  Note
+//    that all of them, by definition, cause the program to exit
+//    if they trigger.
+// --------------------------------------------------------------------
+
+void Gflags::HandleCommandLineHelpFlags() {
+  if (FLAGS_help || FLAGS_helpfull) {
+    ShowUsageWithFlagsRestrict(STDOUT_FILENO, "", false);
+    gflags_exitfunc(1);
+  } else if (!FLAGS_helpon.empty()) {
+    ShowUsageWithFlagsRestrict(STDOUT_FILENO, FLAGS_helpon.c_str(), true);
+    gflags_exitfunc(1);
+  } else if (!FLAGS_helpmatch.empty()) {
+    ShowUsageWithFlagsRestrict(STDOUT_FILENO, FLAGS_helpmatch.c_str(), false);
+    gflags_exitfunc(1);
+  } else if (FLAGS_version) {
+    ShowVersion(STDOUT_FILENO);
+    gflags_exitfunc(0);
+  }
+}
@@ -0,0 +1,311 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <new>
+#include "gflags.h"
+
+using gflags::CommandLineFlag;
+using gflags::Gflags;
+using gflags::SharedFlagSegment;
+using gflags::StringPrintf;
+using gflags::uint32;
+using gflags::uint64;
+using std::atomic;
+using std::string;
+using std::vector;
+
+// Other processes map the segment at other addresses, so the atomics in
+// it must be plain memory words, not something with a lock on the side.
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+              "shared flag segments need lock-free atomics");
+
+// --------------------------------------------------------------------
+// Segment layout
+//    A Header, then one Slot per flag, sorted by name.  Everything but
+//    the seqlocked values is written once, before the magic number is
+//    set, and never changes afterwards.
+// --------------------------------------------------------------------
+
+namespace {
+
+const uint64 kMagic = 0x67666c6167736d31ULL; // "gflagsm1"
+const size_t kValueWords = (SharedFlagSegment::kMaxValueLength + 1) / 8;
+// A slot whose sequence number stays odd this long belongs to a process
+// that died halfway through writing it.
+const int kMaxRetries = 10000;
+
+} // namespace
+
+struct alignas(64) SharedFlagSegment::Header {
+  atomic<uint64> magic; // kMagic once the slots are filled in
+  uint32 num_slots;
+  uint32 slot_size; // sizeof(Slot), so a mismatched build fails Attach()
+  atomic<uint64> generation;
+};
+
+// Slots are a multiple of a cache line, so that a Set() on one flag does
+// not slow down workers reading its neighbours.
+struct alignas(64) SharedFlagSegment::Slot {
+  char name[kMaxNameLength + 1];
+  atomic<uint32> seq; // odd while a writer is in the slot
+  atomic<uint32> length;
+  atomic<uint64> words[kValueWords];
+};
+
+namespace {
+
+typedef SharedFlagSegment::Slot Slot;
+
+// Copies the value through word-sized atomics, so that a reader racing a
+// writer sees a torn value (which it then throws away) rather than
+// undefined behaviour.  The stores are releases and the loads in
+// ReadSlot() acquires: a reader that sees any word of a new value also
+// sees the odd sequence number stored before it, and retries.  This
+// needs no standalone fences, which ThreadSanitizer cannot model.
+void WriteSlot(Slot *slot, const char *value, size_t length) {
+  uint64 buf[kValueWords] = {0};
+  memcpy(buf, value, length);
+  for (size_t i = 0; i * 8 < length; ++i)
+    slot->words[i].store(buf[i], std::memory_order_release);
+  slot->length.store(length, std::memory_order_release);
+}
+
+// Reads a consistent value of slot, with the sequence number it had.
+bool ReadSlot(const Slot &slot, string *value, uint32 *seq) {
+  for (int tries = 0; tries < kMaxRetries; ++tries) {
+    const uint32 before = slot.seq.load(std::memory_order_acquire);
+    if (before & 1) {
+      sched_yield();
+      continue;
+    }
+    size_t length = slot.length.load(std::memory_order_acquire);
+    if (length > SharedFlagSegment::kMaxValueLength)
+      length = SharedFlagSegment::kMaxValueLength; // torn; retried below
+    uint64 buf[kValueWords];
+    for (size_t i = 0; i * 8 < length; ++i)
+      buf[i] = slot.words[i].load(std::memory_order_acquire);
+    if (slot.seq.load(std::memory_order_relaxed) == before) {
+      value->assign(reinterpret_cast<const char *>(buf), length);
+      *seq = before;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool SlotNameLess(const Slot &slot, const char *name) {
+  return strcmp(slot.name, name) < 0;
+}
+
+} // namespace
+
+SharedFlagSegment::SharedFlagSegment()
+    : header_(NULL), size_(0), synced_generation_(~0ULL) {}
+
+SharedFlagSegment::~SharedFlagSegment() {
+  if (header_)
+    munmap(header_, size_);
+}
+
+bool SharedFlagSegment::Map(int fd, size_t size, string *error) {
+  void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  const int saved_errno = errno;
+  close(fd);
+  if (addr == MAP_FAILED) {
+    *error = StringPrintf("mmap: %s", strerror(saved_errno));
+    return false;
+  }
+  if (header_)
+    munmap(header_, size_);
+  header_ = static_cast<Header *>(addr);
+  size_ = size;
+  return true;
+}
+
+// --------------------------------------------------------------------
+// Create()
+//    Unlinks any old segment of the same name instead of truncating it,
+//    so that workers still attached to it keep a valid mapping.
+// --------------------------------------------------------------------
+
+bool SharedFlagSegment::Create(Gflags *gflags, const char *name,
+                               const char *pattern, string *error) {
+  vector<const CommandLineFlag *> flags;
+  gflags->GetFlagsMatching(pattern, &flags);
+  vector<string> values(flags.size());
+  for (size_t i = 0; i < flags.size(); ++i) {
+    if (strlen(flags[i]->name()) > kMaxNameLength) {
+      *error = StringPrintf("flag name '%s' is too long to share",
+                            flags[i]->name());
+      return false;
+    }
+    gflags->GetCommandLineOption(flags[i]->name(), &values[i]);
+    if (values[i].size() > kMaxValueLength) {
+      *error = StringPrintf("value of flag '%s' is too long to share",
+                            flags[i]->name());
+      return false;
+    }
+  }
+
+  shm_unlink(name);
+  const int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    *error = StringPrintf("shm_open(%s): %s", name, strerror(errno));
+    return false;
+  }
+  const size_t size = sizeof(Header) + flags.size() * sizeof(Slot);
+  if (ftruncate(fd, size) != 0) {
+    *error = StringPrintf("ftruncate(%s): %s", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return false;
+  }
+  if (!Map(fd, size, error)) {
+    shm_unlink(name);
+    return false;
+  }
+
+  // The new mapping is zero-filled and nobody reads it before the magic
+  // number is set.
+  Header *header = new (header_) Header;
+  header->num_slots = flags.size();
+  header->slot_size = sizeof(Slot);
+  header->generation.store(0, std::memory_order_relaxed);
+  Slot *slots = reinterpret_cast<Slot *>(header + 1);
+  for (size_t i = 0; i < flags.size(); ++i) {
+    Slot *slot = new (slots + i) Slot;
+    strcpy(slot->name, flags[i]->name());
+    slot->seq.store(0, std::memory_order_relaxed);
+    WriteSlot(slot, values[i].data(), values[i].size());
+  }
+  header->magic.store(kMagic, std::memory_order_release);
+  synced_generation_ = ~0ULL;
+  synced_seq_.assign(flags.size(), ~0U);
+  return true;
+}
+
+bool SharedFlagSegment::Attach(const char *name, string *error) {
+  const int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    *error = StringPrintf("shm_open(%s): %s", name, strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)) {
+    *error = StringPrintf("%s is not a flag segment", name);
+    close(fd);
+    return false;
+  }
+  if (!Map(fd, st.st_size, error))
+    return false;
+  if (header_->magic.load(std::memory_order_acquire) != kMagic ||
+      header_->slot_size != sizeof(Slot) ||
+      sizeof(Header) + header_->num_slots * sizeof(Slot) > size_) {
+    *error = StringPrintf("%s is not a flag segment, or is not ready", name);
+    munmap(header_, size_);
+    header_ = NULL;
+    size_ = 0;
+    return false;
+  }
+  synced_generation_ = ~0ULL;
+  synced_seq_.assign(header_->num_slots, ~0U);
+  return true;
+}
+
+bool SharedFlagSegment::Unlink(const char *name) {
+  return shm_unlink(name) == 0;
+}
+
+const SharedFlagSegment::Slot *
+SharedFlagSegment::FindSlot(const char *name) const {
+  if (header_ == NULL)
+    return NULL;
+  const Slot *begin = reinterpret_cast<const Slot *>(header_ + 1);
+  const Slot *end = begin + header_->num_slots;
+  const Slot *slot = std::lower_bound(begin, end, name, SlotNameLess);
+  if (slot == end || strcmp(slot->name, name) != 0)
+    return NULL;
+  return slot;
+}
+
+// --------------------------------------------------------------------
+// Set()
+//    Writers take a slot by making its sequence number odd, so two
+//    admins setting the same flag take turns; readers never write to
+//    the segment at all.
+// --------------------------------------------------------------------
+
+bool SharedFlagSegment::Set(const char *name, const char *value) {
+  Slot *slot = const_cast<Slot *>(FindSlot(name));
+  const size_t length = strlen(value);
+  if (slot == NULL || length > kMaxValueLength)
+    return false;
+  uint32 seq = slot->seq.load(std::memory_order_relaxed);
+  for (int tries = 0;; ++tries) {
+    if (tries == kMaxRetries)
+      return false;
+    if (seq & 1) {
+      sched_yield();
+      seq = slot->seq.load(std::memory_order_relaxed);
+      continue;
+    }
+    if (slot->seq.compare_exchange_weak(seq, seq + 1,
+                                        std::memory_order_acquire))
+      break;
+  }
+  WriteSlot(slot, value, length); // release stores, after the odd number
+  slot->seq.store(seq + 2, std::memory_order_release);
+  header_->generation.fetch_add(1, std::memory_order_release);
+  return true;
+}
+
+bool SharedFlagSegment::Get(const char *name, string *value) const {
+  const Slot *slot = FindSlot(name);
+  uint32 seq;
+  return slot != NULL && ReadSlot(*slot, value, &seq);
+}
+
+uint64 SharedFlagSegment::generation() const {
+  return header_ ? header_->generation.load(std::memory_order_acquire) : 0;
+}
+
+// --------------------------------------------------------------------
+// Sync()
+//    The generation is read before the slots, so a Set() that lands
+//    while this runs bumps it again and the next Sync() picks it up.
+// --------------------------------------------------------------------
+
+size_t SharedFlagSegment::Sync(Gflags *gflags, vector<string> *rejected) {
+  if (header_ == NULL)
+    return 0;
+  const uint64 generation =
+      header_->generation.load(std::memory_order_acquire);
+  if (generation == synced_generation_)
+    return 0;
+
+  const Slot *slots = reinterpret_cast<const Slot *>(header_ + 1);
+  size_t applied = 0;
+  bool complete = true;
+  string value;
+  for (size_t i = 0; i < synced_seq_.size(); ++i) {
+    const Slot &slot = slots[i];
+    if (slot.seq.load(std::memory_order_relaxed) == synced_seq_[i])
+      continue;
+    uint32 seq;
+    if (!ReadSlot(slot, &value, &seq)) {
+      complete = false; // a writer is stuck in it; try again next time
+      continue;
+    }
+    synced_seq_[i] = seq;
+    if (!gflags->SetCommandLineOption(slot.name, value.c_str()).empty())
+      ++applied;
+    else if (rejected)
+      rejected->push_back(slot.name);
+  }
+  if (complete)
+    synced_generation_ = generation;
+  return applied;
+}
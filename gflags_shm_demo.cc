@@ -0,0 +1,168 @@
+// Multi-process demo of SharedFlagSegment.
+//
+// The admin (this process) publishes the demo_* flags in a shared-memory
+// segment and forks workers, each of which attaches to the segment by
+// name and calls Sync() in its loop, the way a server would once per
+// request.  The admin then sets demo_limit to a new value, round after
+// round, and times how long it takes until every worker's FLAGS_demo_limit
+// holds it.  One round sets a value the workers' validator rejects, which
+// they must ignore.  Exits non-zero if a worker misses a value.
+//
+//   ./gflags_shm_demo --shm_workers=32 --shm_rounds=1000
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+#include "gflags.h"
+
+using gflags::Gflags;
+using gflags::int32;
+using gflags::int64;
+using gflags::MonotonicNanos;
+using gflags::SharedFlagSegment;
+using std::atomic;
+using std::string;
+using std::vector;
+
+DEFINE_int32(shm_workers, 4, "Worker processes to fork");
+DEFINE_int32(shm_rounds, 200, "Values the admin publishes, one at a time");
+DEFINE_string(shm_segment, "/gflags_shm_demo", "Name of the segment");
+DEFINE_double(shm_timeout, 5, "Seconds to wait for the workers each round");
+
+// The shared flags.
+DEFINE_int64(demo_limit, 0, "Changed by the admin; never negative");
+DEFINE_string(demo_mode, "normal", "Published but left alone");
+
+static bool ValidateLimit(const char *, int64 value) { return value >= 0; }
+DEFINE_validator(demo_limit, &ValidateLimit);
+
+// What each worker reports back, in memory shared with the admin.
+struct WorkerState {
+  atomic<int64> seen; // the worker's FLAGS_demo_limit
+  atomic<int64> rejected;
+};
+
+static atomic<bool> *stop;
+
+static int Worker(Gflags *gflags, WorkerState *state) {
+  SharedFlagSegment segment;
+  string error;
+  if (!segment.Attach(FLAGS_shm_segment.c_str(), &error)) {
+    fprintf(stderr, "worker %d: %s\n", getpid(), error.c_str());
+    return 1;
+  }
+  vector<string> rejected;
+  while (!stop->load(std::memory_order_relaxed)) {
+    segment.Sync(gflags, &rejected);
+    state->seen.store(FLAGS_demo_limit, std::memory_order_release);
+    state->rejected.store(rejected.size(), std::memory_order_release);
+    sched_yield(); // stands in for handling a request
+  }
+  return 0;
+}
+
+// Waits until every worker's value of field is value.
+static bool WaitForWorkers(WorkerState *states,
+                           atomic<int64> WorkerState::*field, int64 value) {
+  const int64 deadline = MonotonicNanos() + (int64)(FLAGS_shm_timeout * 1e9);
+  for (int32 i = 0; i < FLAGS_shm_workers; ++i) {
+    while ((states[i].*field).load(std::memory_order_acquire) != value) {
+      if (MonotonicNanos() > deadline) {
+        fprintf(stderr, "worker %d never saw %" PRId64 "\n", i, value);
+        return false;
+      }
+      sched_yield();
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  Gflags gflags;
+  gflags.SetUsageMessage("Propagates flag changes to forked workers");
+  gflags.ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_shm_workers < 1)
+    FLAGS_shm_workers = 1;
+
+  SharedFlagSegment segment;
+  string error;
+  if (!segment.Create(&gflags, FLAGS_shm_segment.c_str(), "demo_*", &error)) {
+    fprintf(stderr, "%s\n", error.c_str());
+    return 1;
+  }
+
+  // Anonymous shared memory for the workers' reports; the flags
+  // themselves travel only through the segment.
+  const size_t report_size =
+      sizeof(atomic<bool>) + 64 + FLAGS_shm_workers * sizeof(WorkerState);
+  void *reports = mmap(NULL, report_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (reports == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  stop = new (reports) atomic<bool>(false);
+  WorkerState *states = reinterpret_cast<WorkerState *>(
+      static_cast<char *>(reports) + 64);
+  for (int32 i = 0; i < FLAGS_shm_workers; ++i) {
+    states[i].seen.store(-1);
+    states[i].rejected.store(0);
+  }
+
+  vector<pid_t> workers;
+  for (int32 i = 0; i < FLAGS_shm_workers; ++i) {
+    const pid_t pid = fork();
+    if (pid < 0) {
+      perror("fork");
+      break;
+    }
+    if (pid == 0)
+      _exit(Worker(&gflags, &states[i]));
+    workers.push_back(pid);
+  }
+
+  bool ok = workers.size() == (size_t)FLAGS_shm_workers &&
+            WaitForWorkers(states, &WorkerState::seen, 0);
+  vector<int64> latency_ns;
+  for (int32 round = 1; ok && round <= FLAGS_shm_rounds; ++round) {
+    const string value = std::to_string(round);
+    const int64 start = MonotonicNanos();
+    segment.Set("demo_limit", value.c_str());
+    ok = WaitForWorkers(states, &WorkerState::seen, round);
+    latency_ns.push_back(MonotonicNanos() - start);
+  }
+  if (ok) {
+    segment.Set("demo_limit", "-1");
+    ok = WaitForWorkers(states, &WorkerState::rejected, 1) &&
+         WaitForWorkers(states, &WorkerState::seen, FLAGS_shm_rounds);
+  }
+
+  stop->store(true);
+  for (size_t i = 0; i < workers.size(); ++i) {
+    int status;
+    waitpid(workers[i], &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      ok = false;
+  }
+  SharedFlagSegment::Unlink(FLAGS_shm_segment.c_str());
+
+  printf("%d workers, %d rounds, generation %" PRIu64 "\n", FLAGS_shm_workers,
+         FLAGS_shm_rounds, segment.generation());
+  if (!latency_ns.empty()) {
+    std::sort(latency_ns.begin(), latency_ns.end());
+    const size_t n = latency_ns.size();
+    printf("set -> seen by all workers: p50 %" PRId64 " ns  p99 %" PRId64
+           " ns  max %" PRId64 " ns\n",
+           latency_ns[n / 2], latency_ns[n * 99 / 100], latency_ns[n - 1]);
+  }
+  printf("%s\n", ok ? "ok" : "FAILED");
+  gflags.ShutDownCommandLineFlags();
+  return ok ? 0 : 1;
+}
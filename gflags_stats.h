@@ -0,0 +1,130 @@
+#ifndef GFLAGS_STATS_H_
+#define GFLAGS_STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <atomic>
+
+// Opt-in instrumentation of the flag library.  Build with
+// GFLAGS_ENABLE_STATS to count registry operations and time them and the
+// registry lock; read the numbers with Gflags::GetStats().  Without it
+// the GFLAGS_STATS_* macros expand to nothing and no counters exist.
+
+namespace gflags {
+
+// Latency histograms have one bucket per power of two: bucket i counts
+// samples of [2^i, 2^(i+1)) nanoseconds, and bucket 0 also takes 0ns.
+static const int kStatsHistogramBuckets = 40;
+
+// A copy of the library's counters, taken by Gflags::GetStats().
+struct FlagStats {
+  bool enabled; // false unless built with GFLAGS_ENABLE_STATS
+
+  uint64_t lookups;       // FindFlagLocked() calls
+  uint64_t lookup_misses; // ... that found nothing
+  uint64_t sets;          // SetFlagLocked() calls
+  uint64_t set_failures;  // ... that left the flag unchanged
+  uint64_t validator_calls;
+  uint64_t validator_failures;
+
+  uint64_t lock_acquisitions; // of FlagRegistry::lock_
+  uint64_t lock_contended;    // ... that had to wait
+  uint64_t lock_wait_ns;      // total time spent waiting
+
+  // The same for the per-shard locks, summed over all shards.  Single-
+  // flag gets and sets hold lock_ shared and contend here instead.
+  uint64_t shard_lock_acquisitions;
+  uint64_t shard_lock_contended;
+  uint64_t shard_lock_wait_ns;
+
+  uint64_t lookup_ns[kStatsHistogramBuckets];
+  uint64_t set_ns[kStatsHistogramBuckets];
+  uint64_t lock_wait_histogram_ns[kStatsHistogramBuckets];
+  uint64_t shard_lock_wait_histogram_ns[kStatsHistogramBuckets];
+};
+
+// The clock for everything the library times, stats or not.
+inline uint64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(GFLAGS_ENABLE_STATS)
+
+class StatsHistogram {
+public:
+  StatsHistogram() {
+    for (int i = 0; i < kStatsHistogramBuckets; ++i)
+      buckets_[i].store(0, std::memory_order_relaxed);
+  }
+
+  void Record(uint64_t ns) {
+    int bucket = ns == 0 ? 0 : 63 - __builtin_clzll(ns);
+    if (bucket >= kStatsHistogramBuckets)
+      bucket = kStatsHistogramBuckets - 1;
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void CopyTo(uint64_t *output) const {
+    for (int i = 0; i < kStatsHistogramBuckets; ++i)
+      output[i] = buckets_[i].load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> buckets_[kStatsHistogramBuckets];
+};
+
+// Records the lifetime of the enclosing scope into a histogram.
+class StatsTimer {
+public:
+  explicit StatsTimer(StatsHistogram *histogram)
+      : histogram_(histogram), start_(MonotonicNanos()) {}
+  ~StatsTimer() { histogram_->Record(MonotonicNanos() - start_); }
+
+private:
+  StatsHistogram *const histogram_;
+  const uint64_t start_;
+};
+
+// Per-Mutex lock statistics, see Mutex::Lock().
+struct MutexStats {
+  std::atomic<uint64_t> acquisitions;
+  std::atomic<uint64_t> contended;
+  std::atomic<uint64_t> wait_ns;
+  StatsHistogram wait_histogram;
+
+  MutexStats() : acquisitions(0), contended(0), wait_ns(0) {}
+};
+
+// Registry operation statistics, kept by FlagRegistry.
+struct RegistryStats {
+  std::atomic<uint64_t> lookups;
+  std::atomic<uint64_t> lookup_misses;
+  std::atomic<uint64_t> sets;
+  std::atomic<uint64_t> set_failures;
+  std::atomic<uint64_t> validator_calls;
+  std::atomic<uint64_t> validator_failures;
+  StatsHistogram lookup_ns;
+  StatsHistogram set_ns;
+
+  RegistryStats()
+      : lookups(0), lookup_misses(0), sets(0), set_failures(0),
+        validator_calls(0), validator_failures(0) {}
+};
+
+#define GFLAGS_STATS_INC(counter)                                              \
+  ((counter).fetch_add(1, std::memory_order_relaxed))
+#define GFLAGS_STATS_TIMER(var, histogram) gflags::StatsTimer var(&(histogram))
+
+#else // !GFLAGS_ENABLE_STATS
+
+#define GFLAGS_STATS_INC(counter) ((void)0)
+#define GFLAGS_STATS_TIMER(var, histogram) ((void)0)
+
+#endif
+
+} // namespace gflags
+
+#endif
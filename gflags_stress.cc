@@ -0,0 +1,189 @@
+// Concurrency stress and throughput harness for the flag registry.
+//
+// Reader threads call GetCommandLineOption() and also read the FLAGS_*
+// variables directly, the way application code does; writer threads
+// call SetCommandLineOption().  Every writer flips each flag between two
+// known values, so a reader that sees anything else has caught a torn
+// value.  At the end it prints ops/sec and latency percentiles for each
+// kind of operation, and exits non-zero if a torn value was seen.
+//
+//   ./gflags_stress --stress_readers=8 --stress_writers=2 --stress_seconds=5
+//
+// Configure with -DGFLAGS_TSAN=ON to run it under ThreadSanitizer.  The
+// raw FLAGS_* reads race with SetCommandLineOption() by design; add
+// --stress_raw_reads=false to check only the registry paths.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "gflags.h"
+
+using gflags::Gflags;
+using gflags::int32;
+using gflags::int64;
+using gflags::MonotonicNanos;
+using gflags::uint64;
+using std::atomic;
+using std::string;
+using std::vector;
+
+DEFINE_int32(stress_readers, 4, "Reader threads");
+DEFINE_int32(stress_writers, 1, "Writer threads");
+DEFINE_double(stress_seconds, 2, "How long to run");
+DEFINE_int32(stress_sample_every, 16,
+             "Time one operation in this many for the percentiles");
+DEFINE_bool(stress_raw_reads, true,
+            "Also read the numeric FLAGS_* variables directly");
+DEFINE_bool(stress_raw_strings, false,
+            "Also read FLAGS_stress_string directly.  This races with "
+            "writers on the string's buffer and may crash; it is there to "
+            "show the race under ThreadSanitizer");
+
+// The flags under stress.  Each is only ever set to one of its two values.
+DEFINE_int64(stress_int64, 1234567890123, "Flipped by writers");
+DEFINE_double(stress_double, 0.5, "Flipped by writers");
+DEFINE_string(stress_string, "short", "Flipped by writers");
+
+struct StressFlag {
+  const char *name;
+  const char *values[2];
+};
+
+static const StressFlag kFlags[] = {
+    {"stress_int64", {"1234567890123", "-1"}},
+    {"stress_double", {"0.5", "-2.25"}},
+    {"stress_string",
+     {"short", "a value long enough to live outside the string object"}},
+};
+static const int kNumFlags = sizeof(kFlags) / sizeof(kFlags[0]);
+
+// Per-thread results.  Raw FLAGS_* reads are too cheap to time.
+struct OpStats {
+  uint64 ops;
+  uint64 bad; // torn values read, or sets that failed
+  vector<int64> sample_ns; // every stress_sample_every-th operation
+
+  OpStats() : ops(0), bad(0) {}
+};
+
+static atomic<bool> stop(false);
+
+static bool IsWrittenValue(const StressFlag &flag, const string &value) {
+  return value == flag.values[0] || value == flag.values[1];
+}
+
+static void Reader(Gflags *gflags, unsigned seed, OpStats *get,
+                   OpStats *raw) {
+  string value;
+  volatile double sink = 0;
+  while (!stop.load(std::memory_order_relaxed)) {
+    seed = seed * 1103515245 + 12345;
+    const StressFlag &flag = kFlags[(seed >> 16) % kNumFlags];
+
+    const bool timed = get->ops % FLAGS_stress_sample_every == 0;
+    const int64 start = timed ? MonotonicNanos() : 0;
+    gflags->GetCommandLineOption(flag.name, &value);
+    if (timed)
+      get->sample_ns.push_back(MonotonicNanos() - start);
+    ++get->ops;
+    if (!IsWrittenValue(flag, value))
+      ++get->bad;
+
+    if (FLAGS_stress_raw_reads) {
+      const int64 i = FLAGS_stress_int64;
+      const double d = FLAGS_stress_double;
+      if ((i != 1234567890123 && i != -1) || (d != 0.5 && d != -2.25))
+        ++raw->bad;
+      sink = sink + d;
+      if (FLAGS_stress_raw_strings)
+        sink = sink + FLAGS_stress_string.size();
+      ++raw->ops;
+    }
+  }
+}
+
+static void Writer(Gflags *gflags, unsigned seed, OpStats *set) {
+  while (!stop.load(std::memory_order_relaxed)) {
+    seed = seed * 1103515245 + 12345;
+    const StressFlag &flag = kFlags[(seed >> 16) % kNumFlags];
+    const char *value = flag.values[(seed >> 8) & 1];
+
+    const bool timed = set->ops % FLAGS_stress_sample_every == 0;
+    const int64 start = timed ? MonotonicNanos() : 0;
+    if (gflags->SetCommandLineOption(flag.name, value).empty())
+      ++set->bad; // the values always parse, so this is a bug
+    if (timed)
+      set->sample_ns.push_back(MonotonicNanos() - start);
+    ++set->ops;
+  }
+}
+
+static void Report(const char *what, const vector<OpStats> &stats,
+                   double seconds) {
+  uint64 ops = 0, bad = 0;
+  vector<int64> samples;
+  for (size_t i = 0; i < stats.size(); ++i) {
+    ops += stats[i].ops;
+    bad += stats[i].bad;
+    samples.insert(samples.end(), stats[i].sample_ns.begin(),
+                   stats[i].sample_ns.end());
+  }
+  if (ops == 0)
+    return;
+  printf("%-4s %12.0f ops/s  bad %" PRIu64, what, ops / seconds, bad);
+  if (!samples.empty()) {
+    std::sort(samples.begin(), samples.end());
+    const size_t n = samples.size();
+    printf("  p50 %" PRId64 " ns  p99 %" PRId64 " ns  p99.9 %" PRId64 " ns",
+           samples[n / 2], samples[n * 99 / 100], samples[n * 999 / 1000]);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  Gflags gflags;
+  gflags.SetUsageMessage("Concurrent get/set stress test for the registry");
+  gflags.ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_stress_sample_every < 1)
+    FLAGS_stress_sample_every = 1;
+  if (FLAGS_stress_readers < 0)
+    FLAGS_stress_readers = 0;
+  if (FLAGS_stress_writers < 0)
+    FLAGS_stress_writers = 0;
+
+  vector<OpStats> gets(FLAGS_stress_readers), raws(FLAGS_stress_readers);
+  vector<OpStats> sets(FLAGS_stress_writers);
+  vector<std::thread> threads;
+  const int64 start = MonotonicNanos();
+  for (int32 i = 0; i < FLAGS_stress_readers; ++i)
+    threads.push_back(std::thread(Reader, &gflags, 2 * i + 1, &gets[i],
+                                  &raws[i]));
+  for (int32 i = 0; i < FLAGS_stress_writers; ++i)
+    threads.push_back(std::thread(Writer, &gflags, 2 * i + 2, &sets[i]));
+
+  std::this_thread::sleep_for(
+      std::chrono::duration<double>(FLAGS_stress_seconds));
+  stop.store(true);
+  for (size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+  const double seconds = (MonotonicNanos() - start) / 1e9;
+
+  printf("%d readers, %d writers, %.2fs\n", FLAGS_stress_readers,
+         FLAGS_stress_writers, seconds);
+  Report("get", gets, seconds);
+  Report("raw", raws, seconds);
+  Report("set", sets, seconds);
+
+  uint64 bad = 0;
+  for (size_t i = 0; i < gets.size(); ++i)
+    bad += gets[i].bad + raws[i].bad;
+  for (size_t i = 0; i < sets.size(); ++i)
+    bad += sets[i].bad;
+  gflags.ShutDownCommandLineFlags();
+  return bad == 0 ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+#include "gflags.h"
+
+using gflags::FlagRegistry;
+using gflags::FlagSuggester;
+using gflags::int32;
+using gflags::MonotonicNanos;
+using gflags::uint64;
+using std::string;
+using std::vector;
+
+namespace {
+
+// How far off a name may be and still count as a typo of a flag: one
+// edit for very short names, up to three for long ones.
+size_t Tolerance(size_t length) {
+  return length <= 3 ? 1 : length <= 8 ? 2 : 3;
+}
+
+bool NameLess(const char *a, const char *b) { return strcmp(a, b) < 0; }
+
+} // namespace
+
+// --------------------------------------------------------------------
+// FlagSuggester
+// --------------------------------------------------------------------
+
+size_t FlagSuggester::EditDistance(const char *a, const char *b) {
+  const size_t n = strlen(b);
+  // One row of the usual dynamic program.  Flag names are short, so
+  // the row almost always fits on the stack.
+  size_t buffer[64];
+  vector<size_t> heap;
+  size_t *row = buffer;
+  if (n + 1 > sizeof(buffer) / sizeof(buffer[0])) {
+    heap.resize(n + 1);
+    row = &heap[0];
+  }
+  for (size_t j = 0; j <= n; ++j)
+    row[j] = j;
+  for (size_t i = 1; a[i - 1] != '\0'; ++i) {
+    size_t diagonal = row[0];
+    row[0] = i;
+    for (size_t j = 1; j <= n; ++j) {
+      const size_t above = row[j];
+      row[j] = std::min(std::min(row[j - 1], above) + 1,
+                        diagonal + (a[i - 1] != b[j - 1]));
+      diagonal = above;
+    }
+  }
+  return row[n];
+}
+
+void FlagSuggester::Add(const char *name) {
+  const Node added = {name, 0, -1, -1};
+  if (nodes_.empty()) {
+    nodes_.push_back(added);
+    return;
+  }
+  int32 node = 0;
+  for (;;) {
+    const size_t d = EditDistance(name, nodes_[node].name);
+    if (d == 0)
+      return; // already there
+    int32 child = nodes_[node].first_child;
+    while (child >= 0 && nodes_[child].distance != d)
+      child = nodes_[child].next_sibling;
+    if (child < 0) {
+      nodes_.push_back(added);
+      nodes_.back().distance = d;
+      nodes_.back().next_sibling = nodes_[node].first_child;
+      nodes_[node].first_child = static_cast<int32>(nodes_.size() - 1);
+      return;
+    }
+    node = child;
+  }
+}
+
+void FlagSuggester::Suggest(const char *name, size_t max_results,
+                            vector<const char *> *output) const {
+  output->clear();
+  if (nodes_.empty())
+    return;
+  const uint64 deadline = MonotonicNanos() + kMaxLookupNanos;
+  // The search radius shrinks to the best distance found so far, so
+  // that output only ever holds the closest names.
+  size_t radius = Tolerance(strlen(name));
+  vector<int32> pending(1, 0);
+  for (size_t visits = 0; !pending.empty(); ++visits) {
+    if (visits == kMaxVisits ||
+        (visits % 64 == 63 && MonotonicNanos() > deadline))
+      break;
+    const Node &node = nodes_[pending.back()];
+    pending.pop_back();
+    const size_t d = EditDistance(name, node.name);
+    if (d < radius) {
+      radius = d;
+      output->clear();
+    }
+    if (d == radius)
+      output->push_back(node.name);
+    for (int32 child = node.first_child; child >= 0;
+         child = nodes_[child].next_sibling) {
+      const size_t edge = nodes_[child].distance;
+      if (edge + radius >= d && edge <= d + radius)
+        pending.push_back(child);
+    }
+  }
+  std::sort(output->begin(), output->end(), NameLess);
+  if (output->size() > max_results)
+    output->resize(max_results);
+}
+
+string FlagRegistry::SuggestFlagsLocked(const char *name) {
+  if (suggester_.empty()) {
+    for (FlagConstIterator i = flags_.begin(); i != flags_.end(); ++i)
+      suggester_.Add(i->first);
+  }
+  vector<const char *> names;
+  suggester_.Suggest(name, 3, &names);
+  if (names.empty())
+    return "";
+  string hint = " (did you mean ";
+  for (size_t i = 0; i < names.size(); ++i) {
+    if (i > 0)
+      hint += i + 1 == names.size() ? " or " : ", ";
+    hint += "--";
+    hint += names[i];
+  }
+  hint += "?)";
+  return hint;
+}
@@ -4,6 +4,10 @@ using std::string;
 
 void (*gflags::gflags_exitfunc)(int) = &exit; // from stdlib.h
 
+const char gflags::kStrippedFlagHelp[] =
+    "\001\002\003\004 (no help available - program built with "
+    "GFLAGS_STRIP_HELP)";
+
 void gflags::ReportError(DieWhenReporting should_die, const char *format, ...) {
   va_list ap;
   va_start(ap, format);
@@ -75,7 +79,7 @@ void gflags::StringAppendF(std::string *output, const char *format, ...) {
 }
 
 bool gflags::TryParseLocked(const CommandLineFlag *flag, FlagValue *flag_value,
-                            const char *value, string *msg) {
+                            const char *value, string *msg, bool *changed) {
   // Use tenative_value, not flag_value, until we know value is valid.
   FlagValue *tentative_value = flag_value->New();
   if (!tentative_value->ParseFrom(value)) {
@@ -85,7 +89,16 @@ bool gflags::TryParseLocked(const CommandLineFlag *flag, FlagValue *flag_value,
     }
     delete tentative_value;
     return false;
-  } else if (!flag->Validate(*tentative_value)) {
+  } else if (flag->constraint() &&
+             !tentative_value->Satisfies(*flag->constraint())) {
+    if (msg) {
+      StringAppendF(msg, "%svalue '%s' for flag '%s' is not in %s\n", kError,
+                    tentative_value->ToString().c_str(), flag->name(),
+                    flag->constraint()->ToString().c_str());
+    }
+    delete tentative_value;
+    return false;
+  } else if (!flag->CallValidator(*tentative_value)) {
     if (msg) {
       StringAppendF(msg,
                     "%sfailed validation of new value '%s' for flag '%s'\n",
@@ -94,6 +107,8 @@ bool gflags::TryParseLocked(const CommandLineFlag *flag, FlagValue *flag_value,
     delete tentative_value;
     return false;
   } else {
+    if (changed)
+      *changed = !flag_value->Equal(*tentative_value);
     flag_value->CopyFrom(*tentative_value);
     if (msg) {
       StringAppendF(msg, "%s set to %s\n", flag->name(),
@@ -1,7 +1,19 @@
 #include "gflags.h"
+#include <new> // placement new for LazyString
 
+using gflags::ByteSize;
 using gflags::clstring;
+using gflags::DoubleList;
+using gflags::Duration;
+using gflags::FlagConstraint;
+using gflags::FlagEnumIndex;
+using gflags::FlagTypeOps;
 using gflags::FlagValue;
+using gflags::Int32List;
+using gflags::Int64List;
+using gflags::LazyString;
+using gflags::StringPrintf;
+using gflags::StringList;
 using gflags::int32;
 using gflags::int64;
 using gflags::uint32;
@@ -9,6 +21,7 @@ using gflags::uint64;
 using gflags::ValidateFnProto;
 using gflags::ValueType;
 using std::string;
+using std::vector;
 
 /***********************FlagValue***********************/
 
@@ -27,6 +40,12 @@ DEFINE_FLAG_TRAITS(int64, ValueType::FV_INT64);
 DEFINE_FLAG_TRAITS(uint64, ValueType::FV_UINT64);
 DEFINE_FLAG_TRAITS(double, ValueType::FV_DOUBLE);
 DEFINE_FLAG_TRAITS(std::string, ValueType::FV_STRING);
+DEFINE_FLAG_TRAITS(Int32List, ValueType::FV_INT32_LIST);
+DEFINE_FLAG_TRAITS(Int64List, ValueType::FV_INT64_LIST);
+DEFINE_FLAG_TRAITS(DoubleList, ValueType::FV_DOUBLE_LIST);
+DEFINE_FLAG_TRAITS(StringList, ValueType::FV_STRING_LIST);
+DEFINE_FLAG_TRAITS(Duration, ValueType::FV_DURATION);
+DEFINE_FLAG_TRAITS(ByteSize, ValueType::FV_BYTES);
 
 #undef DEFINE_FLAG_TRAITS
 
@@ -37,6 +56,275 @@ DEFINE_FLAG_TRAITS(std::string, ValueType::FV_STRING);
 #define OTHER_VALUE_AS(fv, type) *reinterpret_cast<type *>(fv.value_buffer_)
 #define SET_VALUE_AS(type, value) VALUE_AS(type) = (value)
 
+// --------------------------------------------------------------------
+// Number parsing
+//    Each parses the number in [value, end), which must be all of it.
+//    Scalars pass the whole string, list elements the text between
+//    commas; strtoXX stops at the comma by itself.
+// --------------------------------------------------------------------
+
+// Leading 0x puts us in base 16.  But leading 0 does not put us in base 8!
+// It caused too many bugs when we had that behavior.
+static int NumberBase(const char *value) {
+  return value[0] == '0' && (value[1] == 'x' || value[1] == 'X') ? 16 : 10;
+}
+
+static bool ParseInt64(const char *value, const char *end, int64 *r) {
+  if (value == end)
+    return false;
+  char *stop;
+  errno = 0;
+  *r = strto64(value, &stop, NumberBase(value));
+  return errno == 0 && stop == end;
+}
+
+static bool ParseInt32(const char *value, const char *end, int32 *r) {
+  int64 r64;
+  if (!ParseInt64(value, end, &r64))
+    return false;
+  if (static_cast<int32>(r64) != r64) // worked, but number out of range
+    return false;
+  *r = static_cast<int32>(r64);
+  return true;
+}
+
+static bool ParseUint64(const char *value, const char *end, uint64 *r) {
+  while (value != end && *value == ' ')
+    value++;
+  if (value == end || *value == '-')
+    return false; // negative number
+  char *stop;
+  errno = 0;
+  *r = strtou64(value, &stop, NumberBase(value));
+  return errno == 0 && stop == end;
+}
+
+static bool ParseUint32(const char *value, const char *end, uint32 *r) {
+  uint64 r64;
+  if (!ParseUint64(value, end, &r64))
+    return false;
+  if (static_cast<uint32>(r64) != r64) // worked, but number out of range
+    return false;
+  *r = static_cast<uint32>(r64);
+  return true;
+}
+
+static bool ParseDouble(const char *value, const char *end, double *r) {
+  if (value == end)
+    return false;
+  char *stop;
+  errno = 0;
+  *r = strtod(value, &stop);
+  return errno == 0 && stop == end;
+}
+
+// Parses a comma-separated list into list, which is left alone unless
+// every element parses.
+template <typename T>
+static bool ParseList(const char *value,
+                      bool (*parse)(const char *, const char *, T *),
+                      vector<T> *list) {
+  vector<T> parsed;
+  if (*value != '\0') {
+    parsed.reserve(std::count(value, value + strlen(value), ',') + 1);
+    for (;;) {
+      const char *comma = strchr(value, ',');
+      const char *end = comma ? comma : value + strlen(value);
+      T element;
+      if (!parse(value, end, &element))
+        return false;
+      parsed.push_back(element);
+      if (comma == NULL)
+        break;
+      value = comma + 1;
+    }
+  }
+  list->swap(parsed);
+  return true;
+}
+
+static void ParseStringList(const char *value, StringList *list) {
+  list->clear();
+  if (*value == '\0')
+    return;
+  const size_t len = strlen(value);
+  list->reserve(std::count(value, value + len, ',') + 1, len);
+  for (;;) {
+    const char *comma = strchr(value, ',');
+    if (comma == NULL) {
+      list->push_back(value, strlen(value));
+      return;
+    }
+    list->push_back(value, comma - value);
+    value = comma + 1;
+  }
+}
+
+template <typename T>
+static string JoinList(const vector<T> &list, const char *format) {
+  string joined;
+  char buf[64]; // enough to hold even the biggest number
+  for (size_t i = 0; i < list.size(); ++i) {
+    snprintf(buf, sizeof(buf), format, list[i]);
+    if (i > 0)
+      joined += ',';
+    joined += buf;
+  }
+  return joined;
+}
+
+// --------------------------------------------------------------------
+// Units
+//    Durations and sizes are stored as whole nanoseconds and bytes, so
+//    a quantity such as "1.5s" is read as the integer 15 over 10^1 and
+//    scaled exactly, without going through a double.
+// --------------------------------------------------------------------
+
+struct Unit {
+  const char *name;
+  uint64 scale;
+};
+
+// Longer names first wherever one is a prefix of another.
+static const Unit kDurationUnits[] = {
+    {"h", 3600000000000ULL}, {"ms", 1000000},  {"m", 60000000000ULL},
+    {"s", 1000000000},       {"us", 1000},     {"ns", 1},
+};
+
+static const Unit kByteUnits[] = {
+    {"PiB", 1ULL << 50}, {"TiB", 1ULL << 40}, {"GiB", 1ULL << 30},
+    {"MiB", 1ULL << 20}, {"KiB", 1ULL << 10}, {"PB", 1000000000000000ULL},
+    {"TB", 1000000000000ULL}, {"GB", 1000000000}, {"MB", 1000000},
+    {"KB", 1000}, {"kB", 1000}, {"B", 1},
+};
+
+template <size_t N>
+static const Unit *MatchUnit(const Unit (&units)[N], const char **p) {
+  for (size_t i = 0; i < N; ++i) {
+    const size_t len = strlen(units[i].name);
+    if (strncmp(*p, units[i].name, len) == 0) {
+      *p += len;
+      return &units[i];
+    }
+  }
+  return NULL;
+}
+
+// Reads a decimal number such as "12" or "1.25" at *p as digits / 10^k,
+// ignoring the decimal point.
+static bool ParseDecimal(const char **p, uint64 *digits, uint64 *divisor) {
+  const char *s = *p;
+  bool any = false, point = false;
+  *digits = 0;
+  *divisor = 1;
+  for (;; ++s) {
+    if (*s == '.' && !point) {
+      point = true;
+    } else if (*s >= '0' && *s <= '9') {
+      if (__builtin_mul_overflow(*digits, 10, digits) ||
+          __builtin_add_overflow(*digits, *s - '0', digits) ||
+          (point && __builtin_mul_overflow(*divisor, 10, divisor)))
+        return false;
+      any = true;
+    } else {
+      break;
+    }
+  }
+  *p = s;
+  return any;
+}
+
+// digits / divisor * scale, if that is a whole number that fits.
+static bool Scale(uint64 digits, uint64 divisor, uint64 scale, uint64 *r) {
+  // Divide out the common factors first, so that "1.5s" never needs
+  // 15 * 10^9 / 10 to fit before it is divided.
+  for (uint64 a = divisor, b = scale; b != 0;) {
+    const uint64 t = a % b;
+    a = b;
+    b = t;
+    if (b == 0) {
+      divisor /= a;
+      scale /= a;
+    }
+  }
+  return digits % divisor == 0 &&
+         !__builtin_mul_overflow(digits / divisor, scale, r);
+}
+
+static bool ParseDuration(const char *value, Duration *r) {
+  const bool negative = *value == '-';
+  if (*value == '-' || *value == '+')
+    ++value;
+  if (strcmp(value, "0") == 0) {
+    *r = Duration(0);
+    return true;
+  }
+  uint64 total = 0;
+  do {
+    uint64 digits, divisor, nanos;
+    if (!ParseDecimal(&value, &digits, &divisor))
+      return false;
+    const Unit *unit = MatchUnit(kDurationUnits, &value);
+    if (unit == NULL || !Scale(digits, divisor, unit->scale, &nanos) ||
+        __builtin_add_overflow(total, nanos, &total))
+      return false;
+  } while (*value != '\0');
+  // -2^63 is the one value whose magnitude int64 cannot hold.
+  const uint64 limit = static_cast<uint64>(INT64_MAX) + negative;
+  if (total > limit)
+    return false;
+  *r = Duration(negative ? static_cast<int64>(0 - total)
+                         : static_cast<int64>(total));
+  return true;
+}
+
+static bool ParseByteSize(const char *value, ByteSize *r) {
+  uint64 digits, divisor, bytes;
+  if (!ParseDecimal(&value, &digits, &divisor))
+    return false;
+  while (*value == ' ')
+    ++value;
+  uint64 scale = 1; // a bare number is bytes
+  if (*value != '\0') {
+    const Unit *unit = MatchUnit(kByteUnits, &value);
+    if (unit == NULL || *value != '\0')
+      return false;
+    scale = unit->scale;
+  }
+  if (!Scale(digits, divisor, scale, &bytes))
+    return false;
+  *r = ByteSize(bytes);
+  return true;
+}
+
+// The largest unit that divides the quantity evenly, eg "90m" for 1.5h.
+template <size_t N>
+static string FormatWithUnit(const Unit (&units)[N], uint64 n,
+                             const char *sign) {
+  const Unit *best = NULL;
+  for (size_t i = 0; i < N; ++i) {
+    if (n % units[i].scale == 0 &&
+        (best == NULL || units[i].scale > best->scale))
+      best = &units[i];
+  }
+  return StringPrintf("%s%" PRIu64 "%s", sign, n / best->scale, best->name);
+}
+
+static string FormatDuration(Duration d) {
+  if (d.nanoseconds() == 0)
+    return "0";
+  const bool negative = d.nanoseconds() < 0;
+  const uint64 magnitude = negative ? 0 - static_cast<uint64>(d.nanoseconds())
+                                    : static_cast<uint64>(d.nanoseconds());
+  return FormatWithUnit(kDurationUnits, magnitude, negative ? "-" : "");
+}
+
+static string FormatByteSize(ByteSize b) {
+  if (b.bytes() == 0)
+    return "0";
+  return FormatWithUnit(kByteUnits, b.bytes(), "");
+}
+
 // --------------------------------------------------------------------
 // FlagValue
 //    This represent the value a single flag might have.  The major
@@ -44,10 +332,55 @@ DEFINE_FLAG_TRAITS(std::string, ValueType::FV_STRING);
 //    given type, and back.  Thread-compatible.
 // --------------------------------------------------------------------
 
+// Three words on LP64: the buffer, type_ and owns_value_, and the union.
+static_assert(sizeof(void *) != 8 || sizeof(FlagValue) == 24,
+              "FlagValue grew");
+
 template <typename FlagType>
 FlagValue::FlagValue(FlagType *valbuf, bool transfer_ownership_of_value)
     : value_buffer_(valbuf), type_(FlagValueTraits<FlagType>::kValueType),
-      owns_value_(transfer_ownership_of_value) {}
+      owns_value_(transfer_ownership_of_value), lazy_(NULL) {}
+
+// Gflags::RegisterCommandLineFlag() is a template in gflags.h, which
+// only sees the declaration above; instantiate the constructor for every
+// flag type here so that optimized builds, which inline the implicit
+// instantiations in this file away, still link.
+template FlagValue::FlagValue(bool *, bool);
+template FlagValue::FlagValue(int32 *, bool);
+template FlagValue::FlagValue(uint32 *, bool);
+template FlagValue::FlagValue(int64 *, bool);
+template FlagValue::FlagValue(uint64 *, bool);
+template FlagValue::FlagValue(double *, bool);
+template FlagValue::FlagValue(string *, bool);
+template FlagValue::FlagValue(Int32List *, bool);
+template FlagValue::FlagValue(Int64List *, bool);
+template FlagValue::FlagValue(DoubleList *, bool);
+template FlagValue::FlagValue(StringList *, bool);
+template FlagValue::FlagValue(Duration *, bool);
+template FlagValue::FlagValue(ByteSize *, bool);
+
+FlagValue::FlagValue(LazyString *lazy)
+    : value_buffer_(lazy->storage), type_(FV_STRING), owns_value_(false),
+      lazy_(lazy) {}
+
+FlagValue::FlagValue(void *valbuf, const FlagTypeOps *ops,
+                     bool transfer_ownership_of_value)
+    : value_buffer_(valbuf), type_(FV_CUSTOM),
+      owns_value_(transfer_ownership_of_value), ops_(ops) {}
+
+void FlagValue::Materialize() const {
+  if (type_ == FV_STRING && lazy_ != NULL && !lazy_->constructed) {
+    // Never destroyed, like the clstring it replaces.
+    new (lazy_->storage) string(lazy_->literal);
+    lazy_->constructed = true;
+  }
+}
+
+const char *FlagValue::UnbuiltLiteral() const {
+  return type_ == FV_STRING && lazy_ != NULL && !lazy_->constructed
+             ? lazy_->literal
+             : NULL;
+}
 
 FlagValue::~FlagValue() {
   if (!owns_value_) {
@@ -75,11 +408,35 @@ FlagValue::~FlagValue() {
   case FV_STRING:
     delete reinterpret_cast<string *>(value_buffer_);
     break;
+  case FV_INT32_LIST:
+    delete reinterpret_cast<Int32List *>(value_buffer_);
+    break;
+  case FV_INT64_LIST:
+    delete reinterpret_cast<Int64List *>(value_buffer_);
+    break;
+  case FV_DOUBLE_LIST:
+    delete reinterpret_cast<DoubleList *>(value_buffer_);
+    break;
+  case FV_STRING_LIST:
+    delete reinterpret_cast<StringList *>(value_buffer_);
+    break;
+  case FV_DURATION:
+    delete reinterpret_cast<Duration *>(value_buffer_);
+    break;
+  case FV_BYTES:
+    delete reinterpret_cast<ByteSize *>(value_buffer_);
+    break;
+  case FV_CUSTOM:
+    ops_->destroy(value_buffer_);
+    break;
   }
 }
 
 bool FlagValue::ParseFrom(const char *value) {
-  if (type_ == FV_BOOL) {
+  Materialize();
+  if (type_ == FV_CUSTOM) {
+    return ops_->parse(value, value_buffer_);
+  } else if (type_ == FV_BOOL) {
     const char *kTrue[] = {"1", "t", "true", "y", "yes"};
     const char *kFalse[] = {"0", "f", "false", "n", "no"};
     for (size_t i = 0; i < sizeof(kTrue) / sizeof(*kTrue); ++i) {
@@ -99,64 +456,58 @@ bool FlagValue::ParseFrom(const char *value) {
   }
 
   // OK, it's likely to be numeric, and we'll be using a strtoXXX method.
-  if (value[0] == '\0') // empty-string is only allowed for string type.
-    return false;
-  char *end;
-  // Leading 0x puts us in base 16.  But leading 0 does not put us in base 8!
-  // It caused too many bugs when we had that behavior.
-  int base = 10; // by default
-  if (value[0] == '0' && (value[1] == 'x' || value[1] == 'X'))
-    base = 16;
-  errno = 0;
-
+  // The parse helpers reject the empty string, which is only allowed for
+  // strings and (as the empty list) lists.
+  const char *const end = value + strlen(value);
   switch (type_) {
   case FV_INT32: {
-    const int64 r = strto64(value, &end, base);
-    if (errno || end != value + strlen(value))
-      return false;                 // bad parse
-    if (static_cast<int32>(r) != r) // worked, but number out of range
-      return false;
-    SET_VALUE_AS(int32, static_cast<int32>(r));
+    int32 r;
+    if (!ParseInt32(value, end, &r))
+      return false; // bad parse, or out of range
+    SET_VALUE_AS(int32, r);
     return true;
   }
   case FV_UINT32: {
-    while (*value == ' ')
-      value++;
-    if (*value == '-')
-      return false; // negative number
-    const uint64 r = strtou64(value, &end, base);
-    if (errno || end != value + strlen(value))
-      return false;                  // bad parse
-    if (static_cast<uint32>(r) != r) // worked, but number out of range
-      return false;
-    SET_VALUE_AS(uint32, static_cast<uint32>(r));
+    uint32 r;
+    if (!ParseUint32(value, end, &r))
+      return false; // bad parse, or out of range
+    SET_VALUE_AS(uint32, r);
     return true;
   }
   case FV_INT64: {
-    const int64 r = strto64(value, &end, base);
-    if (errno || end != value + strlen(value))
+    int64 r;
+    if (!ParseInt64(value, end, &r))
       return false; // bad parse
     SET_VALUE_AS(int64, r);
     return true;
   }
   case FV_UINT64: {
-    while (*value == ' ')
-      value++;
-    if (*value == '-')
-      return false; // negative number
-    const uint64 r = strtou64(value, &end, base);
-    if (errno || end != value + strlen(value))
+    uint64 r;
+    if (!ParseUint64(value, end, &r))
       return false; // bad parse
     SET_VALUE_AS(uint64, r);
     return true;
   }
   case FV_DOUBLE: {
-    const double r = strtod(value, &end);
-    if (errno || end != value + strlen(value))
+    double r;
+    if (!ParseDouble(value, end, &r))
       return false; // bad parse
     SET_VALUE_AS(double, r);
     return true;
   }
+  case FV_INT32_LIST:
+    return ParseList(value, ParseInt32, &VALUE_AS(Int32List));
+  case FV_INT64_LIST:
+    return ParseList(value, ParseInt64, &VALUE_AS(Int64List));
+  case FV_DOUBLE_LIST:
+    return ParseList(value, ParseDouble, &VALUE_AS(DoubleList));
+  case FV_STRING_LIST:
+    ParseStringList(value, &VALUE_AS(StringList));
+    return true;
+  case FV_DURATION:
+    return ParseDuration(value, &VALUE_AS(Duration));
+  case FV_BYTES:
+    return ParseByteSize(value, &VALUE_AS(ByteSize));
   default: {
     assert(false); // unknown type
     return false;
@@ -165,6 +516,8 @@ bool FlagValue::ParseFrom(const char *value) {
 }
 
 string FlagValue::ToString() const {
+  if (const char *literal = UnbuiltLiteral())
+    return literal;
   char intbuf[64]; // enough to hold even the biggest number
   switch (type_) {
   case FV_BOOL:
@@ -186,6 +539,28 @@ string FlagValue::ToString() const {
     return intbuf;
   case FV_STRING:
     return VALUE_AS(string);
+  case FV_INT32_LIST:
+    return JoinList(VALUE_AS(Int32List), "%" PRId32);
+  case FV_INT64_LIST:
+    return JoinList(VALUE_AS(Int64List), "%" PRId64);
+  case FV_DOUBLE_LIST:
+    return JoinList(VALUE_AS(DoubleList), "%.17g");
+  case FV_STRING_LIST: {
+    const StringList &list = VALUE_AS(StringList);
+    string joined;
+    for (size_t i = 0; i < list.size(); ++i) {
+      if (i > 0)
+        joined += ',';
+      joined.append(list[i], list.length(i));
+    }
+    return joined;
+  }
+  case FV_DURATION:
+    return FormatDuration(VALUE_AS(Duration));
+  case FV_BYTES:
+    return FormatByteSize(VALUE_AS(ByteSize));
+  case FV_CUSTOM:
+    return ops_->format(value_buffer_);
   default:
     assert(false);
     return ""; // unknown type
@@ -194,6 +569,7 @@ string FlagValue::ToString() const {
 
 bool FlagValue::Validate(const char *flagname,
                          ValidateFnProto validate_fn_proto) const {
+  Materialize();
   switch (type_) {
   case FV_BOOL:
     return reinterpret_cast<bool (*)(const char *, bool)>(validate_fn_proto)(
@@ -216,32 +592,114 @@ bool FlagValue::Validate(const char *flagname,
   case FV_STRING:
     return reinterpret_cast<bool (*)(const char *, const string &)>(
         validate_fn_proto)(flagname, VALUE_AS(string));
+  case FV_INT32_LIST:
+    return reinterpret_cast<bool (*)(const char *, const Int32List &)>(
+        validate_fn_proto)(flagname, VALUE_AS(Int32List));
+  case FV_INT64_LIST:
+    return reinterpret_cast<bool (*)(const char *, const Int64List &)>(
+        validate_fn_proto)(flagname, VALUE_AS(Int64List));
+  case FV_DOUBLE_LIST:
+    return reinterpret_cast<bool (*)(const char *, const DoubleList &)>(
+        validate_fn_proto)(flagname, VALUE_AS(DoubleList));
+  case FV_STRING_LIST:
+    return reinterpret_cast<bool (*)(const char *, const StringList &)>(
+        validate_fn_proto)(flagname, VALUE_AS(StringList));
+  case FV_DURATION:
+    return reinterpret_cast<bool (*)(const char *, Duration)>(
+        validate_fn_proto)(flagname, VALUE_AS(Duration));
+  case FV_BYTES:
+    return reinterpret_cast<bool (*)(const char *, ByteSize)>(
+        validate_fn_proto)(flagname, VALUE_AS(ByteSize));
+  case FV_CUSTOM:
+    return ops_->validate(validate_fn_proto, flagname, value_buffer_);
   default:
     assert(false); // unknown type
     return false;
   }
 }
 
+bool FlagValue::Satisfies(const FlagConstraint &constraint) const {
+  Materialize();
+  switch (constraint.kind) {
+  case FC_INT_RANGE:
+    if (type_ == FV_INT32)
+      return constraint.int_lo <= VALUE_AS(int32) &&
+             VALUE_AS(int32) <= constraint.int_hi;
+    if (type_ == FV_INT64)
+      return constraint.int_lo <= VALUE_AS(int64) &&
+             VALUE_AS(int64) <= constraint.int_hi;
+    break;
+  case FC_UINT_RANGE:
+    if (type_ == FV_UINT32)
+      return constraint.uint_lo <= VALUE_AS(uint32) &&
+             VALUE_AS(uint32) <= constraint.uint_hi;
+    if (type_ == FV_UINT64)
+      return constraint.uint_lo <= VALUE_AS(uint64) &&
+             VALUE_AS(uint64) <= constraint.uint_hi;
+    break;
+  case FC_DOUBLE_RANGE:
+    if (type_ == FV_DOUBLE)
+      return constraint.double_lo <= VALUE_AS(double) &&
+             VALUE_AS(double) <= constraint.double_hi;
+    break;
+  case FC_ONEOF:
+    if (type_ == FV_STRING) {
+      const string &value = VALUE_AS(string);
+      const char *choice = constraint.choices;
+      while (true) {
+        const char *end = strchr(choice, '|');
+        const size_t len = end ? end - choice : strlen(choice);
+        if (value.size() == len && value.compare(0, len, choice, len) == 0)
+          return true;
+        if (end == NULL)
+          return false;
+        choice = end + 1;
+      }
+    }
+    break;
+  }
+  assert(false); // the DEFINE_* macros never pair a flag with another type
+  return false;
+}
+
 const char *FlagValue::TypeName() const {
-  static const char types[] = "bool\0xx"
-                              "int32\0x"
-                              "uint32\0"
-                              "int64\0x"
-                              "uint64\0"
-                              "double\0"
-                              "string";
+  static const char types[] = "bool\0xxxxxxx"
+                              "int32\0xxxxxx"
+                              "uint32\0xxxxx"
+                              "int64\0xxxxxx"
+                              "uint64\0xxxxx"
+                              "double\0xxxxx"
+                              "string\0xxxxx"
+                              "int32_list\0x"
+                              "int64_list\0x"
+                              "double_list\0"
+                              "string_list\0"
+                              "duration\0xxx"
+                              "bytes";
+  if (type_ == FV_CUSTOM)
+    return ops_->name;
   if (type_ > FV_MAX_INDEX) {
     assert(false);
     return "";
   }
-  // Directly indexing the strings in the 'types' string, each of them is 7
+  // Directly indexing the strings in the 'types' string, each of them is 12
   // bytes long.
-  return &types[type_ * 7];
+  return &types[type_ * 12];
 }
 
 bool FlagValue::Equal(const FlagValue &x) const {
-  if (type_ != x.type_)
+  if (type_ != x.type_ || (type_ == FV_CUSTOM && ops_ != x.ops_))
     return false;
+  // Compare an unbuilt lazy string by its literal rather than building it;
+  // this is what UpdateModifiedBit() does on every set.
+  const char *literal = UnbuiltLiteral();
+  const char *other_literal = x.UnbuiltLiteral();
+  if (literal && other_literal)
+    return strcmp(literal, other_literal) == 0;
+  if (literal)
+    return OTHER_VALUE_AS(x, string) == literal;
+  if (other_literal)
+    return VALUE_AS(string) == other_literal;
   switch (type_) {
   case FV_BOOL:
     return VALUE_AS(bool) == OTHER_VALUE_AS(x, bool);
@@ -257,6 +715,20 @@ bool FlagValue::Equal(const FlagValue &x) const {
     return VALUE_AS(double) == OTHER_VALUE_AS(x, double);
   case FV_STRING:
     return VALUE_AS(string) == OTHER_VALUE_AS(x, string);
+  case FV_INT32_LIST:
+    return VALUE_AS(Int32List) == OTHER_VALUE_AS(x, Int32List);
+  case FV_INT64_LIST:
+    return VALUE_AS(Int64List) == OTHER_VALUE_AS(x, Int64List);
+  case FV_DOUBLE_LIST:
+    return VALUE_AS(DoubleList) == OTHER_VALUE_AS(x, DoubleList);
+  case FV_STRING_LIST:
+    return VALUE_AS(StringList) == OTHER_VALUE_AS(x, StringList);
+  case FV_DURATION:
+    return VALUE_AS(Duration) == OTHER_VALUE_AS(x, Duration);
+  case FV_BYTES:
+    return VALUE_AS(ByteSize) == OTHER_VALUE_AS(x, ByteSize);
+  case FV_CUSTOM:
+    return ops_->equal(value_buffer_, x.value_buffer_);
   default:
     assert(false);
     return false; // unknown type
@@ -279,6 +751,20 @@ FlagValue *FlagValue::New() const {
     return new FlagValue(new double(0.0), true);
   case FV_STRING:
     return new FlagValue(new string, true);
+  case FV_INT32_LIST:
+    return new FlagValue(new Int32List, true);
+  case FV_INT64_LIST:
+    return new FlagValue(new Int64List, true);
+  case FV_DOUBLE_LIST:
+    return new FlagValue(new DoubleList, true);
+  case FV_STRING_LIST:
+    return new FlagValue(new StringList, true);
+  case FV_DURATION:
+    return new FlagValue(new Duration, true);
+  case FV_BYTES:
+    return new FlagValue(new ByteSize, true);
+  case FV_CUSTOM:
+    return new FlagValue(ops_->create(), ops_, true);
   default:
     assert(false);
     return NULL; // unknown type
@@ -286,7 +772,9 @@ FlagValue *FlagValue::New() const {
 }
 
 void FlagValue::CopyFrom(const FlagValue &x) {
-  assert(type_ == x.type_);
+  assert(type_ == x.type_ && (type_ != FV_CUSTOM || ops_ == x.ops_));
+  Materialize();
+  x.Materialize();
   switch (type_) {
   case FV_BOOL:
     SET_VALUE_AS(bool, OTHER_VALUE_AS(x, bool));
@@ -309,7 +797,115 @@ void FlagValue::CopyFrom(const FlagValue &x) {
   case FV_STRING:
     SET_VALUE_AS(string, OTHER_VALUE_AS(x, string));
     break;
+  case FV_INT32_LIST:
+    SET_VALUE_AS(Int32List, OTHER_VALUE_AS(x, Int32List));
+    break;
+  case FV_INT64_LIST:
+    SET_VALUE_AS(Int64List, OTHER_VALUE_AS(x, Int64List));
+    break;
+  case FV_DOUBLE_LIST:
+    SET_VALUE_AS(DoubleList, OTHER_VALUE_AS(x, DoubleList));
+    break;
+  case FV_STRING_LIST:
+    SET_VALUE_AS(StringList, OTHER_VALUE_AS(x, StringList));
+    break;
+  case FV_DURATION:
+    SET_VALUE_AS(Duration, OTHER_VALUE_AS(x, Duration));
+    break;
+  case FV_BYTES:
+    SET_VALUE_AS(ByteSize, OTHER_VALUE_AS(x, ByteSize));
+    break;
+  case FV_CUSTOM:
+    ops_->copy(value_buffer_, x.value_buffer_);
+    break;
   default:
     assert(false); // unknown type
   }
 }
+
+/***********************FlagEnumIndex***********************/
+
+// FNV-1a, with the seed folded into the start and a final multiply so
+// that the top bits, which pick the slot, depend on every byte.
+uint32 FlagEnumIndex::Hash(const char *name, uint32 seed) {
+  uint32 h = 2166136261u ^ seed;
+  for (; *name != '\0'; ++name) {
+    h ^= static_cast<unsigned char>(*name);
+    h *= 16777619u;
+  }
+  return h * 0x9e3779b1u;
+}
+
+FlagEnumIndex::FlagEnumIndex(const vector<const char *> &names)
+    : names_(names), seed_(0), shift_(31) {
+  for (size_t i = 0; i < names_.size(); ++i) {
+    for (size_t j = 0; j < i; ++j) {
+      if (strcmp(names_[i], names_[j]) == 0)
+        ReportError(DIE, "ERROR: enum name '%s' is in the table twice\n",
+                    names_[i]);
+    }
+  }
+  // With at least twice as many slots as names, a few seeds usually
+  // do; if they don't, try again with twice the slots.
+  size_t size = 2;
+  while (size < 2 * names_.size()) {
+    size *= 2;
+    --shift_;
+  }
+  for (;;) {
+    for (uint32 seed = 1; seed <= 64; ++seed) {
+      seed_ = seed;
+      slots_.assign(size, -1);
+      size_t i = 0;
+      for (; i < names_.size(); ++i) {
+        int32 &slot = slots_[Slot(names_[i])];
+        if (slot >= 0)
+          break; // collision
+        slot = static_cast<int32>(i);
+      }
+      if (i == names_.size())
+        return;
+    }
+    size *= 2;
+    --shift_;
+  }
+}
+
+int32 FlagEnumIndex::Find(const char *name) const {
+  const int32 i = slots_[Slot(name)];
+  return i >= 0 && strcmp(names_[i], name) == 0 ? i : -1;
+}
+
+/***********************FlagConstraint***********************/
+
+string FlagConstraint::ToString() const {
+  switch (kind) {
+  case FC_INT_RANGE:
+    return StringPrintf("[%" PRId64 ", %" PRId64 "]", int_lo, int_hi);
+  case FC_UINT_RANGE:
+    return StringPrintf("[%" PRIu64 ", %" PRIu64 "]", uint_lo, uint_hi);
+  case FC_DOUBLE_RANGE:
+    return StringPrintf("[%.17g, %.17g]", double_lo, double_hi);
+  case FC_ONEOF:
+    return StringPrintf("{%s}", choices);
+  default:
+    assert(false);
+    return ""; // unknown kind
+  }
+}
+
+bool FlagConstraint::Empty() const {
+  switch (kind) {
+  case FC_INT_RANGE:
+    return int_lo > int_hi;
+  case FC_UINT_RANGE:
+    return uint_lo > uint_hi;
+  case FC_DOUBLE_RANGE:
+    return !(double_lo <= double_hi); // also true if either is NaN
+  case FC_ONEOF:
+    return choices == NULL;
+  default:
+    assert(false);
+    return true; // unknown kind
+  }
+}
@@ -0,0 +1,58 @@
+#include "gflags.h"
+
+using gflags::CommandLineFlag;
+using gflags::FlagRegistry;
+using gflags::FlagRegistryLock;
+using gflags::FlagValue;
+using gflags::FlagView;
+using std::pair;
+
+// --------------------------------------------------------------------
+// FlagView
+//    Copies are plain FlagValues that own their buffer, so the typed
+//    pointers handed out by Track() stay put across refreshes.
+// --------------------------------------------------------------------
+
+FlagView::FlagView()
+    : registry_(FlagRegistry::GlobalRegistry()),
+      generation_(registry_->generation()) {}
+
+FlagView::~FlagView() {
+  for (size_t i = 0; i < copies_.size(); ++i)
+    delete copies_[i].second;
+}
+
+const void *FlagView::TrackFlag(const void *flag_ptr) {
+  FlagRegistryLock frl(registry_);
+  const CommandLineFlag *flag = registry_->FindFlagViaPtrLocked(flag_ptr);
+  if (!flag) {
+    ReportError(DIE, "ERROR: FlagView::Track(): no flag found at %p\n",
+                flag_ptr);
+    return NULL;
+  }
+  // Bring the existing copies up to date first, so that all of them are
+  // taken at the same generation.
+  if (registry_->generation() != generation_)
+    RefreshLocked();
+  FlagValue *copy = flag->current_->New();
+  copy->CopyFrom(*flag->current_);
+  copies_.push_back(pair<const CommandLineFlag *, FlagValue *>(flag, copy));
+  return copy->value_buffer_;
+}
+
+void FlagView::Refresh() {
+  FlagRegistryLock frl(registry_);
+  RefreshLocked();
+}
+
+void FlagView::RefreshLocked() {
+  // Sets bump the generation while holding the lock, so reading it here
+  // under the lock pairs it with exactly the values we copy.
+  generation_ = registry_->generation();
+  for (size_t i = 0; i < copies_.size(); ++i) {
+    FlagValue *copy = copies_[i].second;
+    const FlagValue &current = *copies_[i].first->current_;
+    if (!copy->Equal(current))
+      copy->CopyFrom(current);
+  }
+}
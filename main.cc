@@ -15,6 +15,8 @@ static bool ValidateTimeout(const char *flagname, int32_t timeout) {
 }
 DEFINE_validator(timeout, ValidateTimeout);
 
+DEFINE_int32_range(retries, 3, 0, 10, "How many times to retry");
+
 int main(int argc, char **argv) {
   string val;
   Gflags parse;
@@ -24,6 +26,7 @@ int main(int argc, char **argv) {
   cout << parse.GetCommandLineOption("timeout", &val) << endl;
   cout << val << endl;
   cout << FLAGS_timeout << endl;
+  cout << FLAGS_retries << endl;
   parse.ShutDownCommandLineFlags();
   return 0;
 }